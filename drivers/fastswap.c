@@ -9,33 +9,1641 @@
 #include <linux/page-flags.h>
 #include <linux/memcontrol.h>
 #include <linux/smp.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/crypto.h>
+#include <linux/radix-tree.h>
+#include <linux/cgroup.h>
+#include <linux/zsmalloc.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
+#include <linux/mempool.h>
+#include <linux/llist.h>
+#include <crypto/hash.h>
+#include "fastswap.h"
+#include "fastswap_stats.h"
 
-#define B_DRAM 1
-#define B_RDMA 2
+#define SSWAP_MAX_BACKENDS 8
+#define SSWAP_MAX_STACK 4
+#define SSWAP_NAMES_LEN 64
 
-#ifndef BACKEND
-#error "Need to define BACKEND flag"
+/* backends stores go to, tried in order until one takes the page */
+struct sswap_stack {
+  int n;
+  struct sswap_backend_ops *ops[SSWAP_MAX_STACK];
+};
+
+/* registered backends by slot. a backend that joins the stack is pinned
+ * until fastswap unloads, so the pages it holds can always be loaded */
+static struct sswap_backend_ops *sswap_backends[SSWAP_MAX_BACKENDS];
+static bool sswap_pinned[SSWAP_MAX_BACKENDS];
+static struct sswap_stack __rcu *sswap_stack;
+static DEFINE_MUTEX(sswap_backend_lock);
+/* backend calls may sleep */
+DEFINE_STATIC_SRCU(sswap_srcu);
+
+/* slot + 1 of the backend holding each page, 0 for none */
+static u8 *sswap_owner;
+/* pages each backend holds, stores minus invalidates */
+static atomic_long_t sswap_live[SSWAP_MAX_BACKENDS];
+
+/* owners past the backend slots are pages filled with one word, which stay
+ * local. the owner is then an index into sswap_patterns, 0 is zero pages */
+#define SSWAP_OWNER_PATTERN (SSWAP_MAX_BACKENDS + 1)
+/* pages kept compressed in the local victim tier, see sswap_vtree */
+#define SSWAP_OWNER_VICTIM 254
+/* pages that went through the compression stage, see sswap_zentries */
+#define SSWAP_OWNER_REMAP 255
+#define SSWAP_MAX_PATTERNS (SSWAP_OWNER_VICTIM - SSWAP_OWNER_PATTERN)
+
+static unsigned long sswap_patterns[SSWAP_MAX_PATTERNS];
+/* pages using each pattern, zero pages are not counted */
+static unsigned int sswap_pattern_refs[SSWAP_MAX_PATTERNS];
+static DEFINE_SPINLOCK(sswap_pattern_lock);
+static atomic_long_t sswap_same_live;
+static bool same_filled = true;
+module_param(same_filled, bool, 0644);
+MODULE_PARM_DESC(same_filled, "keep pages filled with one repeated word "
+    "local instead of storing them (default: true)");
+
+/* compression stage. with it fastswap hands out remote slots itself
+ * instead of storing a page at its swap offset: pages that don't compress
+ * get a slot each and compressed pages are packed into slab slots, so far
+ * memory only holds their compressed bytes. */
+struct sswap_zentry {
+  u32 slot;
+  u16 off;
+  u16 len; /* 0 for a page stored whole */
+};
+
+/* a slab slot while it is filled and written, looked up by slot */
+struct sswap_zslab {
+  struct page *page;
+  u32 slot;
+  u16 fill;
+};
+
+#define SSWAP_ZSLOT_NONE U32_MAX
+
+enum sswap_compress_mode {
+  SSWAP_COMPRESS_OFF,
+  SSWAP_COMPRESS_ALL,
+  SSWAP_COMPRESS_CGROUPS,
+};
+
+static int compress;
+module_param(compress, int, 0644);
+MODULE_PARM_DESC(compress, "pages to compress: 0 none, 1 all, 2 the ones "
+    "charged to compress_cgroups. the stage is only there when this is not "
+    "0 or dedup is set at load time, it can be changed at runtime then "
+    "(default: 0)");
+static char *compressor = "lz4";
+module_param(compressor, charp, 0444);
+MODULE_PARM_DESC(compressor, "crypto compression algorithm (default: lz4)");
+#define SSWAP_MAX_ZCGROUPS 16
+static unsigned long compress_cgroups[SSWAP_MAX_ZCGROUPS];
+static int ncompress_cgroups;
+module_param_array(compress_cgroups, ulong, &ncompress_cgroups, 0644);
+MODULE_PARM_DESC(compress_cgroups, "inode numbers of the memory cgroups "
+    "whose pages are compressed with compress=2");
+static unsigned long remote_pages;
+module_param(remote_pages, ulong, 0444);
+MODULE_PARM_DESC(remote_pages, "far memory in pages with the compression "
+    "stage, 0 for max_pages (default: 0)");
+static unsigned int compress_max = PAGE_SIZE * 3 / 4;
+module_param(compress_max, uint, 0644);
+MODULE_PARM_DESC(compress_max, "pages compressing to more bytes than this "
+    "are stored whole (default: 3/4 of a page)");
+
+static struct sswap_zentry *sswap_zentries; /* by swap offset */
+static unsigned long *sswap_zslots; /* remote slots in use */
+static u16 *sswap_zrefs; /* pages in each remote slot */
+static u8 *sswap_zowner; /* backend slot + 1 of each remote slot */
+static unsigned long sswap_zhint;
+/* slabs not written yet, local reads come from them */
+static RADIX_TREE(sswap_zlocal, GFP_ATOMIC);
+static struct sswap_zslab *sswap_zopen;
+static struct sswap_zslab *sswap_zspare;
+static DEFINE_SPINLOCK(sswap_zlock);
+static struct crypto_comp * __percpu *sswap_ztfm;
+/* compression output, lz4 can grow a page a little */
+static u8 * __percpu *sswap_zbuf;
+#define SSWAP_ZBUF_SIZE (PAGE_SIZE * 2)
+
+/* a demand read of a compressed page whose slab is remote. frontswap_load
+ * runs with preemption off, so the slab is only posted into a bounce page
+ * there and decompressed by the sswap_poll_load() that follows */
+struct sswap_zpending {
+  struct llist_node node;
+  struct sswap_backend_ops *ops;
+  int cpu; /* the read went to this cpu's queue */
+  struct page *page;
+  struct page *bounce;
+  struct sswap_zentry ze;
+  u64 start;
+};
+
+static DEFINE_PER_CPU(struct llist_head, sswap_zpending);
+static mempool_t *sswap_zpending_pool;
+static mempool_t *sswap_zbounce_pool;
+/* pending demand reads per cpu the pools keep in reserve */
+#define SSWAP_ZPENDING_RESERVE 4
+
+/* dedup, part of the compression stage. pages are hashed on store and an
+ * identical copy in far memory is shared instead of storing another, its
+ * slot's zrefs count the pages sharing it. the index has an entry per
+ * shared copy, refcounted by the pages using it. */
+struct sswap_dentry {
+  struct rb_node node;
+  u32 hash;
+  u32 refs;
+  struct sswap_zentry ze;
+};
+
+static bool dedup;
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "store identical pages once in far memory. needs "
+    "the compression stage, which this sets up with compress=0 when it is "
+    "set at load time (default: false)");
+static u32 *sswap_zhash; /* by swap offset, only with dedup */
+static struct rb_root sswap_dedup_index = RB_ROOT; /* by hash */
+static unsigned long sswap_dedup_entries;
+static unsigned long sswap_dedup_saved; /* pages sharing another's copy */
+/* crc32c, the kernel's one runs on the cpu's crc32 instruction */
+static struct crypto_shash *sswap_dedup_tfm;
+
+/* victim tier. stores are compressed into a local zsmalloc pool first and
+ * only go to far memory when the pool outgrows victim_pages, least recently
+ * stored first. a page being evicted stays in the tier until its far copy
+ * is written, stores to its swap offset wait for that on sswap_vwait. */
+struct sswap_ventry {
+  struct list_head lru;
+  pgoff_t pageid;
+  unsigned long handle;
+  u16 len;
+  bool compress; /* for the compression stage, the page's memcg is gone */
+  bool evicting;
+  bool dead; /* invalidated while evicting, the evictor drops the far copy */
+};
+
+static unsigned long victim_pages;
+module_param(victim_pages, ulong, 0644);
+MODULE_PARM_DESC(victim_pages, "pages of local memory for compressed pages "
+    "on their way to far memory. the tier is only there when this is not 0 "
+    "at load time, it can be resized at runtime then (default: 0)");
+#define SSWAP_VEVICT_BATCH 8
+
+static struct zs_pool *sswap_vpool;
+static RADIX_TREE(sswap_vtree, GFP_ATOMIC); /* by swap offset */
+static LIST_HEAD(sswap_vlru); /* oldest first, without evicting entries */
+static unsigned long sswap_vcount;
+static DEFINE_SPINLOCK(sswap_vlock);
+static DECLARE_WAIT_QUEUE_HEAD(sswap_vwait);
+
+/* fastswap keeps a page's remote copy until its swap slot is freed, so a
+ * clean page that kept its slot is reclaimed without a store */
+static bool keep_clean = true;
+
+static int sswap_keep_clean_set(const char *val, const struct kernel_param *kp)
+{
+  int ret = param_set_bool(val, kp);
+
+  if (!ret)
+    frontswap_keep_clean(keep_clean);
+  return ret;
+}
+
+static const struct kernel_param_ops sswap_keep_clean_param_ops = {
+  .set = sswap_keep_clean_set,
+  .get = param_get_bool,
+};
+module_param_cb(keep_clean, &sswap_keep_clean_param_ops, &keep_clean, 0644);
+MODULE_PARM_DESC(keep_clean, "let swapped in pages that are not written "
+    "keep their swap slot and remote copy when swap runs full, until it is "
+    "nearly exhausted (default: true)");
+
+/* swapin readahead along the page table rather than the swap area */
+static bool vma_readahead;
+
+static int sswap_vma_readahead_set(const char *val,
+                                   const struct kernel_param *kp)
+{
+  int ret = param_set_bool(val, kp);
+
+  if (!ret)
+    swapin_readahead_vma(vma_readahead);
+  return ret;
+}
+
+static const struct kernel_param_ops sswap_vma_readahead_param_ops = {
+  .set = sswap_vma_readahead_set,
+  .get = param_get_bool,
+};
+module_param_cb(vma_readahead, &sswap_vma_readahead_param_ops,
+                &vma_readahead, 0644);
+MODULE_PARM_DESC(vma_readahead, "prefetch the swapped out neighbours of a "
+    "faulting address instead of its neighbours in swap (default: false)");
+
+/* map prefetched pages at the next swap fault next to them */
+static bool fault_around;
+
+static int sswap_fault_around_set(const char *val,
+                                  const struct kernel_param *kp)
+{
+  int ret = param_set_bool(val, kp);
+
+  if (!ret)
+    swapin_fault_around(fault_around);
+  return ret;
+}
+
+static const struct kernel_param_ops sswap_fault_around_param_ops = {
+  .set = sswap_fault_around_set,
+  .get = param_get_bool,
+};
+module_param_cb(fault_around, &sswap_fault_around_param_ops, &fault_around,
+                0644);
+MODULE_PARM_DESC(fault_around, "on a swap fault, also map the neighbouring "
+    "pages whose prefetch completed, saving their minor faults "
+    "(default: false)");
+
+/* prefetch accuracy per memory cgroup. a prefetch counts for the cgroup
+ * whose fault issued it until the kernel reports it used or dropped unused.
+ * every SSWAP_RA_EPOCH of those the cgroup's readahead cap is halved if it
+ * is below prefetch_accuracy and doubled otherwise */
+struct sswap_ra_cgroup {
+  unsigned long ino; /* 0 for a free entry */
+  atomic_long_t issued;
+  atomic_long_t hits;
+  atomic_long_t unused;
+  atomic_t epoch_hits;
+  atomic_t epoch_unused;
+  atomic_t cap;      /* most pages a fault may prefetch */
+  atomic_t asked;    /* the window the last fault asked for */
+  atomic_t probes;
+};
+
+#define SSWAP_RA_CGROUPS 64
+#define SSWAP_RA_EPOCH 32
+#define SSWAP_RA_CAP_MAX 1024
+/* a cgroup capped at 0 still prefetches one page every this many faults */
+#define SSWAP_RA_PROBE 16
+
+static unsigned int prefetch_accuracy = 25;
+module_param(prefetch_accuracy, uint, 0644);
+MODULE_PARM_DESC(prefetch_accuracy, "percent of a cgroup's prefetches that "
+    "must be used for its readahead window to grow, below it the window "
+    "shrinks down to nothing. 0 never throttles (default: 25)");
+
+static struct sswap_ra_cgroup sswap_ra_cgroups[SSWAP_RA_CGROUPS];
+static DEFINE_SPINLOCK(sswap_ra_lock);
+/* by swap offset, entry + 1 of the cgroup an unresolved prefetch counts for */
+static u8 *sswap_ra_owner;
+
+static unsigned long max_pages = 8UL << 20;
+module_param(max_pages, ulong, 0444);
+MODULE_PARM_DESC(max_pages, "largest swap offset in pages fastswap keeps, "
+    "stores past it go to the swap device (default: 8M, 32GB)");
+
+static char sswap_backend_names[SSWAP_NAMES_LEN];
+static int sswap_rebuild_stack(void);
+
+static int sswap_backend_set(const char *val, const struct kernel_param *kp)
+{
+  int ret;
+
+  if (strlen(val) >= SSWAP_NAMES_LEN)
+    return -ENOSPC;
+
+  mutex_lock(&sswap_backend_lock);
+  strlcpy(sswap_backend_names, val, SSWAP_NAMES_LEN);
+  strim(sswap_backend_names);
+  ret = sswap_rebuild_stack();
+  mutex_unlock(&sswap_backend_lock);
+  return ret;
+}
+
+static int sswap_backend_get(char *buf, const struct kernel_param *kp)
+{
+  return scnprintf(buf, PAGE_SIZE, "%s\n", sswap_backend_names);
+}
+
+static const struct kernel_param_ops sswap_backend_param_ops = {
+  .set = sswap_backend_set,
+  .get = sswap_backend_get,
+};
+module_param_cb(backend, &sswap_backend_param_ops, NULL, 0644);
+MODULE_PARM_DESC(backend, "comma separated backends stores go to, the "
+    "next one is tried when a store fails. can be changed at runtime, "
+    "loads keep going to the backend that has the page. empty picks the "
+    "first registered (default: empty)");
+
+enum sswap_stat_item {
+  SSWAP_STORES,
+  SSWAP_STORE_FAILS,
+  SSWAP_LOADS,
+  SSWAP_LOAD_FAILS,
+  SSWAP_ASYNC_LOADS,
+  SSWAP_ASYNC_LOAD_FAILS,
+  SSWAP_POLLS,
+  SSWAP_INVALIDATES,
+  SSWAP_SAME_FILLED_STORES,
+  SSWAP_SAME_FILLED_LOADS,
+  SSWAP_COMPRESSED_STORES,
+  SSWAP_INCOMPRESSIBLE_STORES,
+  SSWAP_COMPRESSED_BYTES,
+  SSWAP_COMPRESSED_LOADS,
+  SSWAP_SLAB_WRITES,
+  SSWAP_VICTIM_STORES,
+  SSWAP_VICTIM_HITS,
+  SSWAP_VICTIM_EVICTIONS,
+  SSWAP_DEDUP_STORES,
+  SSWAP_DEDUP_HITS,
+  SSWAP_DEDUP_COLLISIONS,
+  SSWAP_PREFETCH_HITS,
+  SSWAP_PREFETCH_MAPPED,
+  SSWAP_PREFETCH_UNUSED,
+  SSWAP_PREFETCH_THROTTLED,
+  NR_SSWAP_STAT_ITEMS
+};
+
+static const char * const sswap_stat_names[] = {
+  "stores",
+  "store_fails",
+  "loads",
+  "load_fails",
+  "async_loads",
+  "async_load_fails",
+  "polls",
+  "invalidates",
+  "same_filled_stores",
+  "same_filled_loads",
+  "compressed_stores",
+  "incompressible_stores",
+  "compressed_bytes",
+  "compressed_loads",
+  "slab_writes",
+  "victim_stores",
+  "victim_hits",
+  "victim_evictions",
+  "dedup_stores",
+  "dedup_hits",
+  "dedup_collisions",
+  "prefetch_hits",
+  "prefetch_mapped",
+  "prefetch_unused",
+  "prefetch_throttled",
+};
+
+enum sswap_lat_item {
+  SSWAP_LAT_STORE,      /* sswap_store, post (and drain) of the write */
+  SSWAP_LAT_LOAD,       /* sswap_load, post of the demand read */
+  SSWAP_LAT_LOAD_ASYNC, /* sswap_load_async, post of a prefetch */
+  SSWAP_LAT_POLL,       /* sswap_poll_load, waiting on the demand read */
+  SSWAP_LAT_FAULT,      /* demand read posted until the page is unlocked */
+  SSWAP_LAT_COMPRESS,   /* compressing a page on store */
+  SSWAP_LAT_DECOMPRESS, /* reading (if remote) and decompressing on load */
+  SSWAP_LAT_DEDUP,      /* hashing, and reading back a copy to compare */
+  NR_SSWAP_LAT_ITEMS
+};
+
+static const char * const sswap_lat_names[] = {
+  "store",
+  "load",
+  "load_async",
+  "poll_load",
+  "fault",
+  "compress",
+  "decompress",
+  "dedup",
+};
+
+struct sswap_pcpu_stats {
+  u64 items[NR_SSWAP_STAT_ITEMS];
+  struct sswap_hist lat[NR_SSWAP_LAT_ITEMS];
+};
+
+static DEFINE_PER_CPU(struct sswap_pcpu_stats, sswap_stats);
+/* when the last demand read was posted on this cpu, consumed by the
+ * sswap_poll_load() that follows it in swapin_readahead() */
+static DEFINE_PER_CPU(u64, sswap_fault_start);
+/* backend of the last demand read on this cpu, the one to poll */
+static DEFINE_PER_CPU(struct sswap_backend_ops *, sswap_fault_backend);
+static struct dentry *sswap_debugfs_root;
+
+static inline void sswap_count(enum sswap_stat_item item)
+{
+  this_cpu_inc(sswap_stats.items[item]);
+}
+
+static inline void sswap_lat(enum sswap_lat_item item, u64 start)
+{
+  sswap_hist_record(sswap_stats.lat[item], ktime_get_ns() - start);
+}
+
+/* pinned backends stay registered, the owner's slot is stable */
+static inline struct sswap_backend_ops *sswap_owner_of(pgoff_t pageid)
+{
+  if (unlikely(pageid >= max_pages || !sswap_owner[pageid] ||
+               sswap_owner[pageid] >= SSWAP_OWNER_PATTERN))
+    return NULL;
+
+  return READ_ONCE(sswap_backends[sswap_owner[pageid] - 1]);
+}
+
+/* the scan stops at the first word that differs, which for most pages is
+ * one of the first few */
+static bool sswap_same_filled(struct page *page, unsigned long *value)
+{
+  unsigned long *data = kmap_atomic(page);
+  unsigned int pos, last = PAGE_SIZE / sizeof(*data) - 1;
+  bool same = data[0] == data[last];
+
+  for (pos = 1; same && pos < last; pos++)
+    same = data[pos] == data[0];
+  *value = data[0];
+  kunmap_atomic(data);
+
+  return same;
+}
+
+static int sswap_pattern_get(unsigned long value)
+{
+  int i, free = -1;
+
+  if (!value)
+    return 0;
+
+  spin_lock(&sswap_pattern_lock);
+  for (i = 1; i < SSWAP_MAX_PATTERNS; i++) {
+    if (!sswap_pattern_refs[i]) {
+      if (free < 0)
+        free = i;
+    } else if (sswap_patterns[i] == value) {
+      goto found;
+    }
+  }
+  i = free;
+  if (i > 0)
+    sswap_patterns[i] = value;
+found:
+  if (i > 0)
+    sswap_pattern_refs[i]++;
+  spin_unlock(&sswap_pattern_lock);
+
+  return i;
+}
+
+static void sswap_pattern_put(int i)
+{
+  if (!i)
+    return;
+
+  spin_lock(&sswap_pattern_lock);
+  sswap_pattern_refs[i]--;
+  spin_unlock(&sswap_pattern_lock);
+}
+
+/* fills a same-filled page back in, the page is ready when this returns */
+static int sswap_load_pattern(pgoff_t pageid, struct page *page)
+{
+  unsigned long *data, value;
+  unsigned int pos;
+
+  if (pageid >= max_pages || sswap_owner[pageid] < SSWAP_OWNER_PATTERN ||
+      sswap_owner[pageid] >= SSWAP_OWNER_VICTIM)
+    return -1;
+
+  value = sswap_patterns[sswap_owner[pageid] - SSWAP_OWNER_PATTERN];
+  data = kmap_atomic(page);
+  if (!value)
+    clear_page(data);
+  else
+    for (pos = 0; pos < PAGE_SIZE / sizeof(*data); pos++)
+      data[pos] = value;
+  kunmap_atomic(data);
+
+  SetPageUptodate(page);
+  unlock_page(page);
+  sswap_count(SSWAP_SAME_FILLED_LOADS);
+  return 0;
+}
+
+/* stores the page with the first backend of the stack that takes it */
+static struct sswap_backend_ops *sswap_stack_store(struct page *page,
+                                                   u64 roffset)
+{
+  struct sswap_backend_ops *ops = NULL;
+  struct sswap_stack *stack;
+  int i, idx;
+
+  idx = srcu_read_lock(&sswap_srcu);
+  stack = srcu_dereference(sswap_stack, &sswap_srcu);
+  for (i = 0; stack && i < stack->n; i++) {
+    if (!stack->ops[i]->store(page, roffset)) {
+      ops = stack->ops[i];
+      break;
+    }
+  }
+  if (!ops && stack && stack->n == 1)
+    pr_err("could not store page remotely\n");
+  srcu_read_unlock(&sswap_srcu, idx);
+
+  return ops;
+}
+
+/* caller holds sswap_zlock */
+static u32 sswap_zslot_alloc(void)
+{
+  unsigned long slot;
+
+  slot = find_next_zero_bit(sswap_zslots, remote_pages, sswap_zhint);
+  if (slot >= remote_pages)
+    slot = find_first_zero_bit(sswap_zslots, remote_pages);
+  if (slot >= remote_pages)
+    return SSWAP_ZSLOT_NONE;
+
+  __set_bit(slot, sswap_zslots);
+  sswap_zhint = slot + 1;
+  return slot;
+}
+
+/* the slot's last page is gone. caller holds sswap_zlock, the backend is
+ * told after it is dropped */
+static struct sswap_backend_ops *sswap_zslot_free(u32 slot)
+{
+  struct sswap_backend_ops *ops = NULL;
+
+  if (sswap_zowner[slot]) {
+    ops = sswap_backends[sswap_zowner[slot] - 1];
+    sswap_zowner[slot] = 0;
+    atomic_long_dec(&sswap_live[ops->slot]);
+  }
+  __clear_bit(slot, sswap_zslots);
+  return ops;
+}
+
+static inline void sswap_zslot_invalidate(struct sswap_backend_ops *ops,
+                                          u32 slot)
+{
+  if (ops && ops->invalidate)
+    ops->invalidate((u64)slot << PAGE_SHIFT);
+}
+
+static bool sswap_want_compress(struct page *page)
+{
+  int mode = READ_ONCE(compress);
+#ifdef CONFIG_MEMCG
+  struct mem_cgroup *memcg = page->mem_cgroup;
+  unsigned long ino;
+  int i;
+
+  if (mode == SSWAP_COMPRESS_CGROUPS && memcg) {
+    ino = cgroup_ino(memcg->css.cgroup);
+    for (i = 0; i < ncompress_cgroups; i++)
+      if (compress_cgroups[i] == ino)
+        return true;
+  }
 #endif
+  return mode == SSWAP_COMPRESS_ALL;
+}
+
+/* writes a full slab to the stack. the slab stays readable locally until
+ * its write is done, a slab no backend takes stays local for good */
+static void sswap_zslab_write(struct sswap_zslab *zs)
+{
+  struct sswap_backend_ops *ops, *stale = NULL;
+
+  set_page_writeback(zs->page);
+  ops = sswap_stack_store(zs->page, (u64)zs->slot << PAGE_SHIFT);
+  if (!ops) {
+    end_page_writeback(zs->page);
+    pr_err("slab %u stays local\n", zs->slot);
+    return;
+  }
+  wait_on_page_writeback(zs->page);
+  sswap_count(SSWAP_SLAB_WRITES);
+
+  spin_lock(&sswap_zlock);
+  sswap_zowner[zs->slot] = ops->slot + 1;
+  atomic_long_inc(&sswap_live[ops->slot]);
+  radix_tree_delete(&sswap_zlocal, zs->slot);
+  if (!sswap_zrefs[zs->slot])
+    stale = sswap_zslot_free(zs->slot);
+  spin_unlock(&sswap_zlock);
+
+  sswap_zslot_invalidate(stale, zs->slot);
+  __free_page(zs->page);
+  kfree(zs);
+}
+
+static struct sswap_zslab *sswap_zslab_alloc(void)
+{
+  struct sswap_zslab *zs = kmalloc(sizeof(*zs), GFP_NOIO | __GFP_NOWARN);
+
+  if (!zs)
+    return NULL;
+
+  zs->page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+  if (!zs->page) {
+    kfree(zs);
+    return NULL;
+  }
+  zs->fill = 0;
+  return zs;
+}
+
+/* compresses the page into the open slab. returns nonzero when the page
+ * should be stored whole */
+static int sswap_zstore(pgoff_t pageid, struct page *page)
+{
+  struct sswap_zentry *ze = &sswap_zentries[pageid];
+  struct sswap_zslab *zs, *full = NULL, *spare;
+  unsigned int dlen = SSWAP_ZBUF_SIZE;
+  u64 start = ktime_get_ns();
+  u8 *src, *dst, *buf;
+  int ret;
+
+  if (!READ_ONCE(sswap_zspare)) {
+    spare = sswap_zslab_alloc();
+    if (spare && cmpxchg(&sswap_zspare, NULL, spare)) {
+      __free_page(spare->page);
+      kfree(spare);
+    }
+  }
+  /* returns with preemption off, which keeps us on this cpu's buffer */
+  if (radix_tree_preload(GFP_NOIO))
+    return -ENOMEM;
+
+  buf = *this_cpu_ptr(sswap_zbuf);
+  src = kmap_atomic(page);
+  ret = crypto_comp_compress(*this_cpu_ptr(sswap_ztfm), src, PAGE_SIZE,
+                             buf, &dlen);
+  kunmap_atomic(src);
+  sswap_lat(SSWAP_LAT_COMPRESS, start);
+  if (ret || dlen > compress_max) {
+    radix_tree_preload_end();
+    sswap_count(SSWAP_INCOMPRESSIBLE_STORES);
+    return -E2BIG;
+  }
+
+  spin_lock(&sswap_zlock);
+  zs = sswap_zopen;
+  if (zs && zs->fill + dlen > PAGE_SIZE) {
+    full = zs;
+    zs = NULL;
+  }
+  if (!zs) {
+    zs = sswap_zspare;
+    if (zs)
+      zs->slot = sswap_zslot_alloc();
+    if (!zs || zs->slot == SSWAP_ZSLOT_NONE) {
+      sswap_zopen = NULL;
+      ret = -ENOSPC;
+      goto unlock;
+    }
+    sswap_zspare = NULL;
+    radix_tree_insert(&sswap_zlocal, zs->slot, zs);
+    sswap_zopen = zs;
+  }
+
+  dst = kmap_atomic(zs->page);
+  memcpy(dst + zs->fill, buf, dlen);
+  kunmap_atomic(dst);
+  ze->slot = zs->slot;
+  ze->off = zs->fill;
+  ze->len = dlen;
+  zs->fill += dlen;
+  sswap_zrefs[zs->slot]++;
+unlock:
+  spin_unlock(&sswap_zlock);
+  radix_tree_preload_end();
+
+  if (full)
+    sswap_zslab_write(full);
+  if (ret)
+    return ret;
+
+  sswap_count(SSWAP_COMPRESSED_STORES);
+  this_cpu_add(sswap_stats.items[SSWAP_COMPRESSED_BYTES], dlen);
+  return 0;
+}
+
+/* stores the page whole in a slot of its own */
+static int sswap_zstore_whole(pgoff_t pageid, struct page *page)
+{
+  struct sswap_zentry *ze = &sswap_zentries[pageid];
+  struct sswap_backend_ops *ops;
+  u32 slot;
+
+  spin_lock(&sswap_zlock);
+  slot = sswap_zslot_alloc();
+  spin_unlock(&sswap_zlock);
+  if (slot == SSWAP_ZSLOT_NONE)
+    return -ENOSPC;
+
+  ops = sswap_stack_store(page, (u64)slot << PAGE_SHIFT);
+  spin_lock(&sswap_zlock);
+  if (ops) {
+    sswap_zowner[slot] = ops->slot + 1;
+    sswap_zrefs[slot] = 1;
+    atomic_long_inc(&sswap_live[ops->slot]);
+  } else {
+    __clear_bit(slot, sswap_zslots);
+  }
+  spin_unlock(&sswap_zlock);
+  if (!ops)
+    return -EIO;
+
+  ze->slot = slot;
+  ze->off = 0;
+  ze->len = 0;
+  return 0;
+}
+
+/* reads a remote slot into a page of our own and waits for it. the read
+ * goes to this cpu's queue, so the cpu stays pinned until it is posted and
+ * that cpu's queue is polled, wherever we run by then */
+static int sswap_zread_slot(struct sswap_backend_ops *ops, u32 slot,
+                            struct page *page)
+{
+  int ret, cpu;
+
+  __SetPageLocked(page);
+  cpu = get_cpu();
+  ret = ops->load_sync(page, (u64)slot << PAGE_SHIFT);
+  put_cpu();
+  if (ret) {
+    __ClearPageLocked(page);
+    return ret;
+  }
+  if (ops->caps & SSWAP_CAP_ASYNC_LOAD)
+    ops->poll_load(cpu);
+  wait_on_page_locked(page);
+  /* the backend unlocks a page it could not read without making it
+   * uptodate */
+  return PageUptodate(page) ? 0 : -EIO;
+}
+
+/* decompresses a compressed page at ze from its slab if that is still
+ * local. returns -EAGAIN with the backend holding the slab otherwise */
+static int sswap_zread_local(struct sswap_zentry ze, struct page *page,
+                             struct sswap_backend_ops **opsp)
+{
+  struct sswap_zslab *zs;
+  unsigned int dlen = PAGE_SIZE;
+  u8 *src, *dst;
+  int ret = -ENOENT;
+
+  *opsp = NULL;
+  spin_lock(&sswap_zlock);
+  zs = ze.len ? radix_tree_lookup(&sswap_zlocal, ze.slot) : NULL;
+  if (zs) {
+    src = kmap_atomic(zs->page);
+    dst = kmap_atomic(page);
+    ret = crypto_comp_decompress(*this_cpu_ptr(sswap_ztfm), src + ze.off,
+                                 ze.len, dst, &dlen);
+    kunmap_atomic(dst);
+    kunmap_atomic(src);
+    if (!ret && dlen != PAGE_SIZE)
+      ret = -EIO;
+  } else if (sswap_zowner[ze.slot]) {
+    *opsp = sswap_backends[sswap_zowner[ze.slot] - 1];
+    ret = -EAGAIN;
+  }
+  spin_unlock(&sswap_zlock);
+  return ret;
+}
+
+/* reads the page at ze. compressed pages are decompressed from a slab that
+ * is still local, or from a bounce page the slab is read into */
+static int sswap_zread(struct sswap_zentry ze, struct page *page)
+{
+  struct sswap_backend_ops *ops;
+  struct page *bounce;
+  unsigned int dlen = PAGE_SIZE;
+  u8 *src, *dst;
+  int ret;
+
+  ret = sswap_zread_local(ze, page, &ops);
+  if (ret != -EAGAIN)
+    return ret ? -EIO : 0;
+  if (!ze.len)
+    return sswap_zread_slot(ops, ze.slot, page);
+
+  bounce = alloc_page(GFP_NOIO);
+  if (!bounce)
+    return -ENOMEM;
+  ret = sswap_zread_slot(ops, ze.slot, bounce);
+  if (!ret) {
+    src = kmap_atomic(bounce);
+    dst = kmap_atomic(page);
+    preempt_disable();
+    ret = crypto_comp_decompress(*this_cpu_ptr(sswap_ztfm), src + ze.off,
+                                 ze.len, dst, &dlen);
+    preempt_enable();
+    kunmap_atomic(dst);
+    kunmap_atomic(src);
+  }
+  __free_page(bounce);
+
+  return ret || dlen != PAGE_SIZE ? -EIO : 0;
+}
+
+/* the demand read of a compressed page, without sleeping. a remote slab
+ * is posted into a bounce page and *opsp set to the backend to poll, the
+ * page is decompressed and unlocked by sswap_zfinish() */
+static int sswap_zload_sync(pgoff_t pageid, struct page *page,
+                            struct sswap_backend_ops **opsp)
+{
+  struct sswap_zentry ze = sswap_zentries[pageid];
+  struct sswap_backend_ops *ops;
+  struct sswap_zpending *zp;
+  u64 start = ktime_get_ns();
+  int ret;
+
+  ret = sswap_zread_local(ze, page, &ops);
+  if (ret != -EAGAIN) {
+    if (ret) {
+      pr_err("could not decompress page %lu\n", pageid);
+      return -EIO;
+    }
+    SetPageUptodate(page);
+    unlock_page(page);
+    sswap_count(SSWAP_COMPRESSED_LOADS);
+    sswap_lat(SSWAP_LAT_DECOMPRESS, start);
+    return 0;
+  }
+
+  zp = mempool_alloc(sswap_zpending_pool, GFP_ATOMIC | __GFP_NOWARN);
+  if (!zp)
+    return -ENOMEM;
+  zp->bounce = mempool_alloc(sswap_zbounce_pool, GFP_ATOMIC | __GFP_NOWARN);
+  if (!zp->bounce) {
+    mempool_free(zp, sswap_zpending_pool);
+    return -ENOMEM;
+  }
+  zp->ops = ops;
+  zp->page = page;
+  zp->ze = ze;
+  zp->start = start;
+
+  __SetPageLocked(zp->bounce);
+  zp->cpu = get_cpu();
+  ret = ops->load_sync(zp->bounce, (u64)ze.slot << PAGE_SHIFT);
+  if (!ret)
+    llist_add(&zp->node, this_cpu_ptr(&sswap_zpending));
+  put_cpu();
+  if (ret) {
+    __ClearPageLocked(zp->bounce);
+    mempool_free(zp->bounce, sswap_zbounce_pool);
+    mempool_free(zp, sswap_zpending_pool);
+    return ret;
+  }
+
+  *opsp = ops;
+  return 0;
+}
+
+/* decompresses the demand reads sswap_zload_sync() posted on cpu */
+static void sswap_zfinish(int cpu)
+{
+  struct llist_node *nodes = llist_del_all(per_cpu_ptr(&sswap_zpending, cpu));
+  struct sswap_zpending *zp, *tmp;
+  unsigned int dlen;
+  u8 *src, *dst;
+  int ret;
+
+  llist_for_each_entry_safe(zp, tmp, nodes, node) {
+    /* another task's read, posted after the poll that brought us here */
+    if (PageLocked(zp->bounce) && (zp->ops->caps & SSWAP_CAP_ASYNC_LOAD))
+      zp->ops->poll_load(zp->cpu);
+    wait_on_page_locked(zp->bounce);
+
+    dlen = PAGE_SIZE;
+    ret = -EIO;
+    if (PageUptodate(zp->bounce)) {
+      src = kmap_atomic(zp->bounce);
+      dst = kmap_atomic(zp->page);
+      ret = crypto_comp_decompress(*this_cpu_ptr(sswap_ztfm),
+                                   src + zp->ze.off, zp->ze.len, dst, &dlen);
+      kunmap_atomic(dst);
+      kunmap_atomic(src);
+    }
+    /* a page left not uptodate fails the fault rather than mapping junk */
+    if (ret || dlen != PAGE_SIZE) {
+      pr_err("could not decompress page %lu\n", page_private(zp->page));
+    } else {
+      SetPageUptodate(zp->page);
+      sswap_count(SSWAP_COMPRESSED_LOADS);
+      sswap_lat(SSWAP_LAT_DECOMPRESS, zp->start);
+    }
+    unlock_page(zp->page);
+
+    ClearPageUptodate(zp->bounce);
+    mempool_free(zp->bounce, sswap_zbounce_pool);
+    mempool_free(zp, sswap_zpending_pool);
+  }
+}
+
+/* prefetches of compressed pages are synchronous, there is no completion
+ * to hook the decompression to */
+static int sswap_zload(pgoff_t pageid, struct page *page)
+{
+  u64 start = ktime_get_ns();
+
+  if (sswap_zread(sswap_zentries[pageid], page)) {
+    pr_err("could not decompress page %lu\n", pageid);
+    return -EIO;
+  }
+  SetPageUptodate(page);
+  unlock_page(page);
+  sswap_count(SSWAP_COMPRESSED_LOADS);
+  sswap_lat(SSWAP_LAT_DECOMPRESS, start);
+  return 0;
+}
+
+/* caller holds sswap_zlock. the leftmost entry with this hash */
+static struct sswap_dentry *sswap_dedup_first(u32 hash)
+{
+  struct rb_node *n = sswap_dedup_index.rb_node;
+  struct sswap_dentry *de, *found = NULL;
+
+  while (n) {
+    de = rb_entry(n, struct sswap_dentry, node);
+    if (hash < de->hash) {
+      n = n->rb_left;
+    } else if (hash > de->hash) {
+      n = n->rb_right;
+    } else {
+      found = de;
+      n = n->rb_left;
+    }
+  }
+  return found;
+}
+
+static inline struct sswap_dentry *sswap_dedup_next(struct sswap_dentry *de)
+{
+  struct rb_node *n = rb_next(&de->node);
+  struct sswap_dentry *next = n ? rb_entry(n, struct sswap_dentry, node) : NULL;
+
+  return next && next->hash == de->hash ? next : NULL;
+}
+
+/* caller holds sswap_zlock. drops a page's reference on the entry of its
+ * copy, pages stored without one have no entry to find */
+static void sswap_dedup_put(const struct sswap_zentry *ze, u32 hash)
+{
+  struct sswap_dentry *de;
+
+  for (de = sswap_dedup_first(hash); de; de = sswap_dedup_next(de)) {
+    if (de->ze.slot != ze->slot || de->ze.off != ze->off)
+      continue;
+    if (--de->refs) {
+      sswap_dedup_saved--;
+      return;
+    }
+    rb_erase(&de->node, &sswap_dedup_index);
+    sswap_dedup_entries--;
+    kfree(de);
+    return;
+  }
+}
+
+/* drops a reference on the remote copy at ze and on its dedup entry */
+static void sswap_zput(const struct sswap_zentry *ze, u32 hash)
+{
+  struct sswap_backend_ops *ops = NULL;
+  bool stale = false;
+
+  spin_lock(&sswap_zlock);
+  if (sswap_zhash)
+    sswap_dedup_put(ze, hash);
+  /* slabs are freed once written, see sswap_zslab_write() */
+  if (!--sswap_zrefs[ze->slot] &&
+      !radix_tree_lookup(&sswap_zlocal, ze->slot)) {
+    ops = sswap_zslot_free(ze->slot);
+    stale = true;
+  }
+  spin_unlock(&sswap_zlock);
+
+  if (stale)
+    sswap_zslot_invalidate(ops, ze->slot);
+}
+
+static u32 sswap_dedup_hash(struct page *page)
+{
+  SHASH_DESC_ON_STACK(desc, sswap_dedup_tfm);
+  u32 hash = 0;
+  u8 *src;
+
+  desc->tfm = sswap_dedup_tfm;
+  desc->flags = 0;
+  src = kmap_atomic(page);
+  crypto_shash_digest(desc, src, PAGE_SIZE, (u8 *)&hash);
+  kunmap_atomic(src);
+
+  return hash;
+}
+
+static bool sswap_pages_same(struct page *a, struct page *b)
+{
+  u8 *pa = kmap_atomic(a), *pb = kmap_atomic(b);
+  bool same = !memcmp(pa, pb, PAGE_SIZE);
+
+  kunmap_atomic(pb);
+  kunmap_atomic(pa);
+  return same;
+}
+
+/* stores the page as one more reference to an identical copy in far
+ * memory. the first copy with the same hash is read back and compared, a
+ * collision stores the page like any other. returns nonzero then */
+static int sswap_dedup_store(pgoff_t pageid, struct page *page)
+{
+  struct sswap_zentry ze;
+  struct sswap_dentry *de;
+  u64 start = ktime_get_ns();
+  struct page *copy;
+  bool same = false;
+  u32 hash;
+
+  sswap_count(SSWAP_DEDUP_STORES);
+  hash = sswap_dedup_hash(page);
+  sswap_zhash[pageid] = hash;
+
+  spin_lock(&sswap_zlock);
+  de = sswap_dedup_first(hash);
+  if (de && sswap_zrefs[de->ze.slot] < U16_MAX) {
+    ze = de->ze;
+    de->refs++;
+    sswap_dedup_saved++;
+    sswap_zrefs[ze.slot]++;
+  } else {
+    de = NULL;
+  }
+  spin_unlock(&sswap_zlock);
+  if (!de)
+    goto out;
+
+  copy = alloc_page(GFP_NOIO | __GFP_NOWARN);
+  if (copy) {
+    same = !sswap_zread(ze, copy) && sswap_pages_same(page, copy);
+    __free_page(copy);
+  }
+  if (!same) {
+    sswap_zput(&ze, hash);
+    if (copy)
+      sswap_count(SSWAP_DEDUP_COLLISIONS);
+    goto out;
+  }
+  sswap_zentries[pageid] = ze;
+  sswap_count(SSWAP_DEDUP_HITS);
+
+out:
+  sswap_lat(SSWAP_LAT_DEDUP, start);
+  return same ? 0 : -ENOENT;
+}
+
+/* indexes the copy just stored for the page, pages without an entry are
+ * only missed by later stores */
+static void sswap_dedup_insert(pgoff_t pageid)
+{
+  struct sswap_dentry *de, *cur;
+  struct rb_node **link = &sswap_dedup_index.rb_node, *parent = NULL;
+
+  de = kmalloc(sizeof(*de), GFP_NOIO | __GFP_NOWARN);
+  if (!de)
+    return;
+  de->hash = sswap_zhash[pageid];
+  de->ze = sswap_zentries[pageid];
+  de->refs = 1;
+
+  spin_lock(&sswap_zlock);
+  while (*link) {
+    parent = *link;
+    cur = rb_entry(parent, struct sswap_dentry, node);
+    link = de->hash < cur->hash ? &parent->rb_left : &parent->rb_right;
+  }
+  rb_link_node(&de->node, parent, link);
+  rb_insert_color(&de->node, &sswap_dedup_index);
+  sswap_dedup_entries++;
+  spin_unlock(&sswap_zlock);
+}
+
+/* stores the page in far memory through the compression stage if there is
+ * one. returns the page's owner, 0 with the page still under writeback when
+ * no backend took it */
+static u8 sswap_store_far(pgoff_t pageid, struct page *page, bool compress)
+{
+  struct sswap_backend_ops *ops;
+  bool dedup_page;
+
+  if (sswap_zentries) {
+    dedup_page = sswap_zhash && READ_ONCE(dedup);
+    if (dedup_page && !sswap_dedup_store(pageid, page)) {
+      end_page_writeback(page);
+      return SSWAP_OWNER_REMAP;
+    }
+    if (compress && !sswap_zstore(pageid, page))
+      end_page_writeback(page);
+    else if (sswap_zstore_whole(pageid, page))
+      return 0;
+    if (dedup_page)
+      sswap_dedup_insert(pageid);
+    return SSWAP_OWNER_REMAP;
+  }
+
+  ops = sswap_stack_store(page, pageid << PAGE_SHIFT);
+  if (!ops)
+    return 0;
+  atomic_long_inc(&sswap_live[ops->slot]);
+  return ops->slot + 1;
+}
+
+/* caller holds sswap_vlock */
+static int sswap_vdecompress(struct sswap_ventry *ve, struct page *page)
+{
+  unsigned int dlen = PAGE_SIZE;
+  u8 *src, *dst;
+  int ret;
+
+  src = zs_map_object(sswap_vpool, ve->handle, ZS_MM_RO);
+  dst = kmap_atomic(page);
+  ret = crypto_comp_decompress(*this_cpu_ptr(sswap_ztfm), src, ve->len,
+                               dst, &dlen);
+  kunmap_atomic(dst);
+  zs_unmap_object(sswap_vpool, ve->handle);
+
+  return ret || dlen != PAGE_SIZE ? -EIO : 0;
+}
+
+/* compresses the page into the tier. returns nonzero when it should go to
+ * far memory right away */
+static int sswap_vstore(pgoff_t pageid, struct page *page)
+{
+  gfp_t gfp = __GFP_NORETRY | __GFP_NOWARN | __GFP_KSWAPD_RECLAIM |
+              __GFP_HIGHMEM | __GFP_MOVABLE;
+  unsigned int dlen = SSWAP_ZBUF_SIZE;
+  u64 start = ktime_get_ns();
+  struct sswap_ventry *ve;
+  unsigned long handle;
+  u8 *src, *dst, *buf;
+  int ret;
+
+  ve = kmalloc(sizeof(*ve), GFP_NOIO | __GFP_NOWARN);
+  if (!ve)
+    return -ENOMEM;
+  ve->pageid = pageid;
+  ve->compress = sswap_want_compress(page);
+  ve->evicting = false;
+  ve->dead = false;
+
+  /* returns with preemption off, which keeps us on this cpu's buffer */
+  if (radix_tree_preload(GFP_NOIO)) {
+    kfree(ve);
+    return -ENOMEM;
+  }
+
+  buf = *this_cpu_ptr(sswap_zbuf);
+  src = kmap_atomic(page);
+  ret = crypto_comp_compress(*this_cpu_ptr(sswap_ztfm), src, PAGE_SIZE,
+                             buf, &dlen);
+  kunmap_atomic(src);
+  sswap_lat(SSWAP_LAT_COMPRESS, start);
+  if (ret || dlen > compress_max) {
+    ret = -E2BIG;
+    goto fail;
+  }
 
-#if BACKEND == B_DRAM
-#define DRAM
-#include "fastswap_dram.h"
-#elif BACKEND == B_RDMA
-#define RDMA
-#include "fastswap_rdma.h"
-#else
-#error "BACKEND can only be 1 (DRAM) or 2 (RDMA)"
-#endif
+  handle = zs_malloc(sswap_vpool, dlen, gfp);
+  if (!handle) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+  dst = zs_map_object(sswap_vpool, handle, ZS_MM_WO);
+  memcpy(dst, buf, dlen);
+  zs_unmap_object(sswap_vpool, handle);
+  ve->handle = handle;
+  ve->len = dlen;
+
+  spin_lock(&sswap_vlock);
+  radix_tree_insert(&sswap_vtree, pageid, ve);
+  list_add_tail(&ve->lru, &sswap_vlru);
+  sswap_vcount++;
+  /* set under the lock, an eviction may pick the page up right away */
+  sswap_owner[pageid] = SSWAP_OWNER_VICTIM;
+  spin_unlock(&sswap_vlock);
+  radix_tree_preload_end();
+
+  sswap_count(SSWAP_VICTIM_STORES);
+  return 0;
+
+fail:
+  radix_tree_preload_end();
+  kfree(ve);
+  return ret;
+}
+
+/* loads a page from the tier, the page is ready when this returns 0 */
+static int sswap_vload(pgoff_t pageid, struct page *page)
+{
+  struct sswap_ventry *ve;
+  u64 start = ktime_get_ns();
+  int ret = -ENOENT;
+
+  if (!sswap_vpool || pageid >= max_pages ||
+      sswap_owner[pageid] != SSWAP_OWNER_VICTIM)
+    return -ENOENT;
+
+  /* an eviction that finished sets the far owner before the entry goes */
+  spin_lock(&sswap_vlock);
+  ve = radix_tree_lookup(&sswap_vtree, pageid);
+  if (ve && !ve->dead)
+    ret = sswap_vdecompress(ve, page);
+  spin_unlock(&sswap_vlock);
+  if (ret)
+    return ret;
+
+  SetPageUptodate(page);
+  unlock_page(page);
+  sswap_count(SSWAP_VICTIM_HITS);
+  sswap_lat(SSWAP_LAT_DECOMPRESS, start);
+  return 0;
+}
+
+/* called under the swap info lock like sswap_drop() */
+static void sswap_vdrop(pgoff_t pageid)
+{
+  struct sswap_ventry *ve;
+
+  spin_lock(&sswap_vlock);
+  ve = radix_tree_lookup(&sswap_vtree, pageid);
+  if (ve && ve->evicting) {
+    ve->dead = true;
+    ve = NULL;
+  } else if (ve) {
+    radix_tree_delete(&sswap_vtree, pageid);
+    list_del(&ve->lru);
+    sswap_vcount--;
+  }
+  sswap_owner[pageid] = 0;
+  spin_unlock(&sswap_vlock);
+
+  if (ve) {
+    zs_free(sswap_vpool, ve->handle);
+    kfree(ve);
+  }
+}
+
+/* the backend and offset holding the page, NULL for pages kept locally or
+ * compressed */
+static struct sswap_backend_ops *sswap_route(pgoff_t pageid, u64 *roffset)
+{
+  struct sswap_zentry *ze;
+  u8 owner;
+
+  if (unlikely(pageid >= max_pages))
+    return NULL;
+
+  owner = sswap_owner[pageid];
+  if (owner == SSWAP_OWNER_REMAP) {
+    ze = &sswap_zentries[pageid];
+    if (ze->len)
+      return NULL;
+    *roffset = (u64)ze->slot << PAGE_SHIFT;
+    return READ_ONCE(sswap_backends[sswap_zowner[ze->slot] - 1]);
+  }
+
+  *roffset = (u64)pageid << PAGE_SHIFT;
+  return sswap_owner_of(pageid);
+}
+
+/* loads of pages no backend gets to see */
+static int sswap_load_local(pgoff_t pageid, struct page *page)
+{
+  if (pageid < max_pages && sswap_owner[pageid] == SSWAP_OWNER_REMAP)
+    return sswap_zload(pageid, page);
+
+  return sswap_load_pattern(pageid, page);
+}
+
+/* drops the page's reference on its remote slot */
+static void sswap_zdrop(pgoff_t pageid)
+{
+  sswap_zput(&sswap_zentries[pageid], sswap_zhash ? sswap_zhash[pageid] : 0);
+  sswap_owner[pageid] = 0;
+}
+
+/* tells the backend holding the page that its slot is free. called under
+ * the swap info lock, backends must not sleep in invalidate */
+static void sswap_drop(pgoff_t pageid)
+{
+  struct sswap_backend_ops *ops = sswap_owner_of(pageid);
+  u8 owner = pageid < max_pages ? sswap_owner[pageid] : 0;
+
+  if (owner == SSWAP_OWNER_REMAP) {
+    sswap_zdrop(pageid);
+    return;
+  }
+  if (owner == SSWAP_OWNER_VICTIM) {
+    sswap_vdrop(pageid);
+    return;
+  }
+  if (owner >= SSWAP_OWNER_PATTERN) {
+    sswap_pattern_put(owner - SSWAP_OWNER_PATTERN);
+    sswap_owner[pageid] = 0;
+    atomic_long_dec(&sswap_same_live);
+    return;
+  }
+  if (!ops)
+    return;
+
+  if (ops->invalidate)
+    ops->invalidate(pageid << PAGE_SHIFT);
+  sswap_owner[pageid] = 0;
+  atomic_long_dec(&sswap_live[ops->slot]);
+}
+
+/* true while an eviction still writes the page at this swap offset */
+static bool sswap_vbusy(pgoff_t pageid)
+{
+  bool busy;
+
+  spin_lock(&sswap_vlock);
+  busy = radix_tree_lookup(&sswap_vtree, pageid);
+  spin_unlock(&sswap_vlock);
+
+  return busy;
+}
+
+/* writes the least recently stored page of the tier to far memory */
+static int sswap_vevict(void)
+{
+  struct sswap_ventry *ve;
+  struct page *page;
+  u8 owner = 0;
+  int ret = 0;
+
+  page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+  if (!page)
+    return -ENOMEM;
+
+  spin_lock(&sswap_vlock);
+  ve = list_first_entry_or_null(&sswap_vlru, struct sswap_ventry, lru);
+  if (ve) {
+    list_del_init(&ve->lru);
+    ve->evicting = true;
+    ret = sswap_vdecompress(ve, page);
+  }
+  spin_unlock(&sswap_vlock);
+  if (!ve) {
+    __free_page(page);
+    return -ENOENT;
+  }
+
+  if (!ret) {
+    set_page_writeback(page);
+    owner = sswap_store_far(ve->pageid, page, ve->compress);
+    if (owner)
+      wait_on_page_writeback(page);
+    else
+      end_page_writeback(page);
+  }
+  __free_page(page);
+
+  spin_lock(&sswap_vlock);
+  ve->evicting = false;
+  if (!owner && !ve->dead) {
+    /* stays local, the tier is over its size until far memory is back */
+    list_add_tail(&ve->lru, &sswap_vlru);
+    spin_unlock(&sswap_vlock);
+    pr_err("could not evict page %lu\n", ve->pageid);
+    return -EIO;
+  }
+  if (owner) {
+    sswap_owner[ve->pageid] = owner;
+    if (ve->dead)
+      sswap_drop(ve->pageid);
+  }
+  radix_tree_delete(&sswap_vtree, ve->pageid);
+  sswap_vcount--;
+  spin_unlock(&sswap_vlock);
+
+  wake_up_all(&sswap_vwait);
+  zs_free(sswap_vpool, ve->handle);
+  kfree(ve);
+  sswap_count(SSWAP_VICTIM_EVICTIONS);
+  return 0;
+}
+
+/* evicts while the pool is over victim_pages. a store evicts a few pages at
+ * most, shrinking the tier at runtime is spread over the next stores */
+static void sswap_vshrink(void)
+{
+  int i;
+
+  for (i = 0; i < SSWAP_VEVICT_BATCH; i++) {
+    if (zs_get_total_pages(sswap_vpool) <= READ_ONCE(victim_pages))
+      break;
+    if (sswap_vevict())
+      break;
+  }
+}
 
+/* with a stack of one, a failed store is the backend's error. past the
+ * first backend it means the page is still local */
 static int sswap_store(unsigned type, pgoff_t pageid,
         struct page *page)
 {
-  if (sswap_rdma_write(page, pageid << PAGE_SHIFT)) {
-    pr_err("could not store page remotely\n");
-    return -1;
+  u64 start = ktime_get_ns();
+  unsigned long value;
+  u8 owner;
+  int i;
+
+  sswap_count(SSWAP_STORES);
+  if (unlikely(pageid >= max_pages))
+    goto fail;
+
+  /* frontswap invalidates a slot before storing to it again, this only
+   * catches a store that raced with a backend switch */
+  if (unlikely(sswap_owner[pageid]))
+    sswap_drop(pageid);
+  /* the far copy of an evicted page may still be on its way there */
+  if (sswap_vpool)
+    wait_event(sswap_vwait, !sswap_vbusy(pageid));
+
+  if (same_filled && sswap_same_filled(page, &value)) {
+    i = sswap_pattern_get(value);
+    if (i >= 0) {
+      sswap_owner[pageid] = SSWAP_OWNER_PATTERN + i;
+      atomic_long_inc(&sswap_same_live);
+      end_page_writeback(page);
+      sswap_count(SSWAP_SAME_FILLED_STORES);
+      sswap_lat(SSWAP_LAT_STORE, start);
+      return 0;
+    }
+  }
+
+  if (sswap_vpool && READ_ONCE(victim_pages) &&
+      !sswap_vstore(pageid, page)) {
+    end_page_writeback(page);
+    goto out;
   }
 
+  owner = sswap_store_far(pageid, page, sswap_want_compress(page));
+  if (!owner)
+    goto fail;
+  sswap_owner[pageid] = owner;
+
+out:
+  if (sswap_vpool)
+    sswap_vshrink();
+  sswap_lat(SSWAP_LAT_STORE, start);
   return 0;
+
+fail:
+  sswap_count(SSWAP_STORE_FAILS);
+  return -1;
+}
+
+
+/* inode of the current task's memory cgroup, all tasks share one entry
+ * without memcg */
+static unsigned long sswap_current_cgroup(void)
+{
+#ifdef CONFIG_MEMCG
+  unsigned long ino;
+
+  rcu_read_lock();
+  ino = cgroup_ino(task_css(current, memory_cgrp_id)->cgroup);
+  rcu_read_unlock();
+  return ino;
+#else
+  return 1;
+#endif
+}
+
+/* the current task's cgroup entry, NULL once all entries are taken.
+ * entries are never given back, the first SSWAP_RA_CGROUPS cgroups that
+ * fault are tracked */
+static struct sswap_ra_cgroup *sswap_ra_cgroup(void)
+{
+  unsigned long ino = sswap_current_cgroup();
+  struct sswap_ra_cgroup *rc = NULL;
+  int i;
+
+  for (i = 0; i < SSWAP_RA_CGROUPS; i++)
+    if (READ_ONCE(sswap_ra_cgroups[i].ino) == ino)
+      return &sswap_ra_cgroups[i];
+
+  spin_lock(&sswap_ra_lock);
+  for (i = 0; i < SSWAP_RA_CGROUPS; i++) {
+    if (sswap_ra_cgroups[i].ino == ino) {
+      rc = &sswap_ra_cgroups[i];
+      break;
+    }
+    if (!rc && !sswap_ra_cgroups[i].ino)
+      rc = &sswap_ra_cgroups[i];
+  }
+  if (rc && !rc->ino) {
+    atomic_set(&rc->cap, SSWAP_RA_CAP_MAX);
+    smp_wmb();
+    WRITE_ONCE(rc->ino, ino);
+  }
+  spin_unlock(&sswap_ra_lock);
+  return rc;
+}
+
+static void sswap_ra_issue(pgoff_t pageid)
+{
+  struct sswap_ra_cgroup *rc = sswap_ra_cgroup();
+
+  if (!rc)
+    return;
+  atomic_long_inc(&rc->issued);
+  sswap_ra_owner[pageid] = rc - sswap_ra_cgroups + 1;
+}
+
+static void sswap_ra_adjust(struct sswap_ra_cgroup *rc)
+{
+  unsigned int hits, unused, cap;
+
+  if (atomic_read(&rc->epoch_hits) + atomic_read(&rc->epoch_unused) <
+      SSWAP_RA_EPOCH)
+    return;
+  hits = atomic_xchg(&rc->epoch_hits, 0);
+  unused = atomic_xchg(&rc->epoch_unused, 0);
+  /* another event took this epoch, hand back what came in meanwhile */
+  if (hits + unused < SSWAP_RA_EPOCH) {
+    atomic_add(hits, &rc->epoch_hits);
+    atomic_add(unused, &rc->epoch_unused);
+    return;
+  }
+
+  cap = atomic_read(&rc->cap);
+  if (hits * 100 < READ_ONCE(prefetch_accuracy) * (hits + unused))
+    cap = min_t(unsigned int, cap, atomic_read(&rc->asked)) / 2;
+  else
+    cap = min_t(unsigned int, max(2 * cap, 1U), SSWAP_RA_CAP_MAX);
+  atomic_set(&rc->cap, cap);
+}
+
+/* may run under the swap cache's tree_lock with interrupts off */
+static void sswap_prefetch_event(unsigned type, pgoff_t pageid, int event)
+{
+  struct sswap_ra_cgroup *rc;
+  u8 i;
+
+  if (pageid >= max_pages)
+    return;
+  i = xchg(&sswap_ra_owner[pageid], 0);
+  if (!i)
+    return;
+
+  rc = &sswap_ra_cgroups[i - 1];
+  if (event != FRONTSWAP_PREFETCH_UNUSED) {
+    /* a page fault around mapped is a hit that took no fault */
+    if (event == FRONTSWAP_PREFETCH_MAPPED)
+      sswap_count(SSWAP_PREFETCH_MAPPED);
+    atomic_long_inc(&rc->hits);
+    atomic_inc(&rc->epoch_hits);
+    sswap_count(SSWAP_PREFETCH_HITS);
+  } else {
+    atomic_long_inc(&rc->unused);
+    atomic_inc(&rc->epoch_unused);
+    sswap_count(SSWAP_PREFETCH_UNUSED);
+  }
+  sswap_ra_adjust(rc);
+}
+
+static unsigned int sswap_prefetch_window(unsigned type, unsigned int nr)
+{
+  struct sswap_ra_cgroup *rc;
+  unsigned int cap;
+
+  if (!READ_ONCE(prefetch_accuracy))
+    return nr;
+  rc = sswap_ra_cgroup();
+  if (!rc)
+    return nr;
+
+  atomic_set(&rc->asked, nr);
+  cap = atomic_read(&rc->cap);
+  /* probe now and then so a cgroup at 0 notices when it would pay off */
+  if (!cap && !(atomic_inc_return(&rc->probes) % SSWAP_RA_PROBE))
+    cap = 1;
+  if (cap >= nr)
+    return nr;
+
+  sswap_count(SSWAP_PREFETCH_THROTTLED);
+  return cap;
 }
 
 /*
@@ -44,37 +1652,109 @@ static int sswap_store(unsigned type, pgoff_t pageid,
  */
 static int sswap_load_async(unsigned type, pgoff_t pageid, struct page *page)
 {
-  if (unlikely(sswap_rdma_read_async(page, pageid << PAGE_SHIFT))) {
+  struct sswap_backend_ops *ops = NULL;
+  u64 start = ktime_get_ns();
+  u64 roffset;
+
+  sswap_count(SSWAP_ASYNC_LOADS);
+  if (!sswap_vload(pageid, page))
+    goto out;
+  ops = sswap_route(pageid, &roffset);
+  if (!ops && !sswap_load_local(pageid, page))
+    goto out;
+
+  if (unlikely(!ops || ops->load_async(page, roffset))) {
     pr_err("could not read page remotely\n");
+    sswap_count(SSWAP_ASYNC_LOAD_FAILS);
     return -1;
   }
 
+out:
+  /* async loads are the kernel's prefetches */
+  sswap_ra_issue(pageid);
+  sswap_lat(SSWAP_LAT_LOAD_ASYNC, start);
   return 0;
 }
 
 static int sswap_load(unsigned type, pgoff_t pageid, struct page *page)
 {
-  if (unlikely(sswap_rdma_read_sync(page, pageid << PAGE_SHIFT))) {
+  struct sswap_backend_ops *ops = NULL;
+  u64 start = ktime_get_ns();
+  u64 roffset;
+
+  sswap_count(SSWAP_LOADS);
+  if (!sswap_vload(pageid, page))
+    goto out;
+  ops = sswap_route(pageid, &roffset);
+  /* called with preemption off, compressed pages must not sleep */
+  if (!ops && pageid < max_pages &&
+      sswap_owner[pageid] == SSWAP_OWNER_REMAP) {
+    if (!sswap_zload_sync(pageid, page, &ops))
+      goto out;
+    pr_err("could not read compressed page\n");
+    sswap_count(SSWAP_LOAD_FAILS);
+    return -1;
+  }
+  if (!ops && !sswap_load_local(pageid, page))
+    goto out;
+
+  if (unlikely(!ops || ops->load_sync(page, roffset))) {
     pr_err("could not read page remotely\n");
+    sswap_count(SSWAP_LOAD_FAILS);
     return -1;
   }
 
+out:
+  sswap_lat(SSWAP_LAT_LOAD, start);
+  this_cpu_write(sswap_fault_start, start);
+  this_cpu_write(sswap_fault_backend, ops);
   return 0;
 }
 
 static int sswap_poll_load(int cpu)
 {
-  return sswap_rdma_poll_load(cpu);
+  struct sswap_backend_ops *ops = per_cpu(sswap_fault_backend, cpu);
+  u64 start = ktime_get_ns();
+  u64 fault_start;
+  int ret = 0;
+
+  sswap_count(SSWAP_POLLS);
+  if (ops && (ops->caps & SSWAP_CAP_ASYNC_LOAD))
+    ret = ops->poll_load(cpu);
+  if (sswap_zentries)
+    sswap_zfinish(cpu);
+  sswap_lat(SSWAP_LAT_POLL, start);
+
+  fault_start = per_cpu(sswap_fault_start, cpu);
+  if (fault_start) {
+    per_cpu(sswap_fault_start, cpu) = 0;
+    sswap_lat(SSWAP_LAT_FAULT, fault_start);
+  }
+
+  return ret;
 }
 
 static void sswap_invalidate_page(unsigned type, pgoff_t offset)
 {
-  return;
+  sswap_count(SSWAP_INVALIDATES);
+  if (offset < max_pages)
+    sswap_ra_owner[offset] = 0;
+  sswap_drop(offset);
 }
 
+/* swapoff, the pages were loaded and invalidated one by one already so
+ * this only sweeps up what is left */
 static void sswap_invalidate_area(unsigned type)
 {
-  pr_err("sswap_invalidate_area\n");
+  unsigned long pageid;
+  u8 *p = sswap_owner, *end = sswap_owner + max_pages;
+
+  while ((p = memchr_inv(p, 0, end - p))) {
+    pageid = p - sswap_owner;
+    sswap_drop(pageid);
+    p++;
+  }
+  pr_info("sswap_invalidate_area\n");
 }
 
 static void sswap_init(unsigned type)
@@ -82,6 +1762,120 @@ static void sswap_init(unsigned type)
   pr_info("sswap_init end\n");
 }
 
+static struct sswap_backend_ops *sswap_find_backend(const char *name,
+                                                    size_t len)
+{
+  int i;
+
+  for (i = 0; i < SSWAP_MAX_BACKENDS; i++)
+    if (sswap_backends[i] && strlen(sswap_backends[i]->name) == len &&
+        !strncmp(sswap_backends[i]->name, name, len))
+      return sswap_backends[i];
+
+  return NULL;
+}
+
+/* builds the stack from the backend parameter, names that are not
+ * registered yet are skipped and picked up when they register.
+ * caller holds sswap_backend_lock */
+static int sswap_rebuild_stack(void)
+{
+  struct sswap_stack *stack, *old;
+  struct sswap_backend_ops *ops;
+  const char *name = sswap_backend_names;
+  size_t len;
+  int i;
+
+  stack = kzalloc(sizeof(*stack), GFP_KERNEL);
+  if (!stack)
+    return -ENOMEM;
+
+  while (*name && stack->n < SSWAP_MAX_STACK) {
+    len = strcspn(name, ",");
+    ops = sswap_find_backend(name, len);
+    if (ops)
+      stack->ops[stack->n++] = ops;
+    else
+      pr_info("backend %.*s is not registered\n", (int)len, name);
+    name += len;
+    if (*name)
+      name++;
+  }
+
+  if (!sswap_backend_names[0])
+    for (i = 0; i < SSWAP_MAX_BACKENDS && !stack->n; i++)
+      if (sswap_backends[i])
+        stack->ops[stack->n++] = sswap_backends[i];
+
+  for (i = 0; i < stack->n; i++) {
+    ops = stack->ops[i];
+    if (sswap_pinned[ops->slot])
+      continue;
+    if (!try_module_get(ops->owner)) {
+      kfree(stack);
+      return -ENODEV;
+    }
+    sswap_pinned[ops->slot] = true;
+  }
+
+  old = rcu_dereference_protected(sswap_stack,
+                                  lockdep_is_held(&sswap_backend_lock));
+  rcu_assign_pointer(sswap_stack, stack);
+  synchronize_srcu(&sswap_srcu);
+  kfree(old);
+
+  for (i = 0; i < stack->n; i++)
+    pr_info("stores go to %s%s\n", stack->ops[i]->name,
+            i ? " when the backends before it fail" : "");
+  return 0;
+}
+
+int sswap_register_backend(struct sswap_backend_ops *ops)
+{
+  int i, ret = -ENOSPC;
+
+  if (!ops->store || !ops->load_sync || !ops->load_async ||
+      ((ops->caps & SSWAP_CAP_ASYNC_LOAD) && !ops->poll_load))
+    return -EINVAL;
+
+  mutex_lock(&sswap_backend_lock);
+  if (sswap_find_backend(ops->name, strlen(ops->name))) {
+    ret = -EEXIST;
+    goto out;
+  }
+
+  for (i = 0; i < SSWAP_MAX_BACKENDS; i++) {
+    if (!sswap_backends[i]) {
+      ops->slot = i;
+      WRITE_ONCE(sswap_backends[i], ops);
+      break;
+    }
+  }
+  if (i == SSWAP_MAX_BACKENDS)
+    goto out;
+
+  pr_info("backend %s registered\n", ops->name);
+  ret = sswap_rebuild_stack();
+  if (ret)
+    sswap_backends[i] = NULL;
+out:
+  mutex_unlock(&sswap_backend_lock);
+  return ret;
+}
+EXPORT_SYMBOL(sswap_register_backend);
+
+/* a backend can only go away before it joined the stack, after that
+ * fastswap holds a reference to its module */
+void sswap_unregister_backend(struct sswap_backend_ops *ops)
+{
+  mutex_lock(&sswap_backend_lock);
+  WARN_ON(sswap_pinned[ops->slot]);
+  sswap_backends[ops->slot] = NULL;
+  mutex_unlock(&sswap_backend_lock);
+  pr_info("backend %s unregistered\n", ops->name);
+}
+EXPORT_SYMBOL(sswap_unregister_backend);
+
 static struct frontswap_ops sswap_frontswap_ops = {
   .init = sswap_init,
   .store = sswap_store,
@@ -90,27 +1884,406 @@ static struct frontswap_ops sswap_frontswap_ops = {
   .load_async = sswap_load_async,
   .invalidate_page = sswap_invalidate_page,
   .invalidate_area = sswap_invalidate_area,
+  .prefetch_window = sswap_prefetch_window,
+  .prefetch_event = sswap_prefetch_event,
+};
+
+static int sswap_stats_show(struct seq_file *m, void *v)
+{
+  u64 sum[NR_SSWAP_STAT_ITEMS] = {};
+  int cpu, i;
+
+  for_each_possible_cpu(cpu) {
+    struct sswap_pcpu_stats *s = per_cpu_ptr(&sswap_stats, cpu);
+
+    for (i = 0; i < NR_SSWAP_STAT_ITEMS; i++)
+      sum[i] += s->items[i];
+  }
+
+  for (i = 0; i < NR_SSWAP_STAT_ITEMS; i++)
+    seq_printf(m, "%s %llu\n", sswap_stat_names[i], sum[i]);
+
+  /* in hundredths, page bytes over compressed bytes */
+  if (sum[SSWAP_COMPRESSED_BYTES])
+    seq_printf(m, "compression_ratio %llu\n",
+               div64_u64(sum[SSWAP_COMPRESSED_STORES] * PAGE_SIZE * 100,
+                         sum[SSWAP_COMPRESSED_BYTES]));
+  /* in hundredths, pages hashed over copies stored for them */
+  if (sum[SSWAP_DEDUP_STORES] > sum[SSWAP_DEDUP_HITS])
+    seq_printf(m, "dedup_ratio %llu\n",
+               div64_u64(sum[SSWAP_DEDUP_STORES] * 100,
+                         sum[SSWAP_DEDUP_STORES] - sum[SSWAP_DEDUP_HITS]));
+  /* in percent of all loads */
+  if (sum[SSWAP_LOADS] + sum[SSWAP_ASYNC_LOADS])
+    seq_printf(m, "victim_hit_rate %llu\n",
+               div64_u64(sum[SSWAP_VICTIM_HITS] * 100,
+                         sum[SSWAP_LOADS] + sum[SSWAP_ASYNC_LOADS]));
+  /* in percent of the prefetches that were used or dropped */
+  if (sum[SSWAP_PREFETCH_HITS] + sum[SSWAP_PREFETCH_UNUSED])
+    seq_printf(m, "prefetch_accuracy %llu\n",
+               div64_u64(sum[SSWAP_PREFETCH_HITS] * 100,
+                         sum[SSWAP_PREFETCH_HITS] +
+                         sum[SSWAP_PREFETCH_UNUSED]));
+
+  return 0;
+}
+
+/* one line per memory cgroup that prefetched, by cgroup inode */
+static int sswap_prefetch_show(struct seq_file *m, void *v)
+{
+  struct sswap_ra_cgroup *rc;
+  long hits, unused;
+  int i;
+
+  for (i = 0; i < SSWAP_RA_CGROUPS; i++) {
+    rc = &sswap_ra_cgroups[i];
+    if (!READ_ONCE(rc->ino))
+      continue;
+
+    hits = atomic_long_read(&rc->hits);
+    unused = atomic_long_read(&rc->unused);
+    seq_printf(m, "%lu issued=%ld hits=%ld unused=%ld accuracy=%ld cap=%d\n",
+               rc->ino, atomic_long_read(&rc->issued), hits, unused,
+               hits + unused ? hits * 100 / (hits + unused) : 100,
+               atomic_read(&rc->cap));
+  }
+
+  return 0;
+}
+
+static int sswap_latency_show(struct seq_file *m, void *v)
+{
+  struct sswap_hist sum;
+  int cpu, i;
+
+  for (i = 0; i < NR_SSWAP_LAT_ITEMS; i++) {
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu)
+      sswap_hist_add(&sum, &per_cpu_ptr(&sswap_stats, cpu)->lat[i]);
+    sswap_hist_show(m, sswap_lat_names[i], &sum);
+  }
+
+  return 0;
+}
+
+static int sswap_backends_show(struct seq_file *m, void *v)
+{
+  struct sswap_backend_ops *ops;
+  struct sswap_stack *stack;
+  int i, j, pos;
+
+  mutex_lock(&sswap_backend_lock);
+  stack = rcu_dereference_protected(sswap_stack,
+                                    lockdep_is_held(&sswap_backend_lock));
+  for (i = 0; i < SSWAP_MAX_BACKENDS; i++) {
+    ops = sswap_backends[i];
+    if (!ops)
+      continue;
+
+    pos = 0;
+    for (j = 0; stack && j < stack->n; j++)
+      if (stack->ops[j] == ops)
+        pos = j + 1;
+    seq_printf(m, "%s caps=%s%s stack=%d pinned=%d live_bytes=%ld\n",
+               ops->name,
+               ops->caps & SSWAP_CAP_ASYNC_STORE ? "async_store," : "",
+               ops->caps & SSWAP_CAP_ASYNC_LOAD ? "async_load," : "",
+               pos, sswap_pinned[i],
+               atomic_long_read(&sswap_live[i]) << PAGE_SHIFT);
+  }
+  mutex_unlock(&sswap_backend_lock);
+  seq_printf(m, "same_filled live_bytes=%ld\n",
+             atomic_long_read(&sswap_same_live) << PAGE_SHIFT);
+  if (sswap_zentries) {
+    spin_lock(&sswap_zlock);
+    seq_printf(m, "remote_slots used=%lu of %lu\n",
+               bitmap_weight(sswap_zslots, remote_pages), remote_pages);
+    if (sswap_zhash)
+      seq_printf(m, "dedup copies=%lu saved_bytes=%lu\n",
+                 sswap_dedup_entries, sswap_dedup_saved << PAGE_SHIFT);
+    spin_unlock(&sswap_zlock);
+  }
+  if (sswap_vpool) {
+    spin_lock(&sswap_vlock);
+    seq_printf(m, "victim_tier pages=%lu pool_pages=%lu of %lu\n",
+               sswap_vcount, zs_get_total_pages(sswap_vpool),
+               READ_ONCE(victim_pages));
+    spin_unlock(&sswap_vlock);
+  }
+
+  return 0;
+}
+
+static int sswap_backends_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_backends_show, NULL);
+}
+
+static int sswap_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_stats_show, NULL);
+}
+
+static int sswap_latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_latency_show, NULL);
+}
+
+static int sswap_prefetch_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_prefetch_show, NULL);
+}
+
+/* any write resets all counters and histograms */
+static ssize_t sswap_reset_write(struct file *file, const char __user *buf,
+                                 size_t count, loff_t *ppos)
+{
+  int cpu, i;
+
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(&sswap_stats, cpu), 0, sizeof(struct sswap_pcpu_stats));
+  /* the caps and the epochs in progress stay */
+  for (i = 0; i < SSWAP_RA_CGROUPS; i++) {
+    atomic_long_set(&sswap_ra_cgroups[i].issued, 0);
+    atomic_long_set(&sswap_ra_cgroups[i].hits, 0);
+    atomic_long_set(&sswap_ra_cgroups[i].unused, 0);
+  }
+
+  return count;
+}
 
+static const struct file_operations sswap_stats_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_latency_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_latency_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_prefetch_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_prefetch_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_backends_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_backends_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = sswap_reset_write,
+  .llseek = noop_llseek,
 };
 
 static int __init sswap_init_debugfs(void)
 {
+  sswap_debugfs_root = debugfs_create_dir("fastswap", NULL);
+  if (IS_ERR_OR_NULL(sswap_debugfs_root))
+    return -ENOMEM;
+
+  debugfs_create_file("stats", S_IRUGO, sswap_debugfs_root, NULL,
+                      &sswap_stats_fops);
+  debugfs_create_file("latency", S_IRUGO, sswap_debugfs_root, NULL,
+                      &sswap_latency_fops);
+  debugfs_create_file("backends", S_IRUGO, sswap_debugfs_root, NULL,
+                      &sswap_backends_fops);
+  debugfs_create_file("prefetch", S_IRUGO, sswap_debugfs_root, NULL,
+                      &sswap_prefetch_fops);
+  debugfs_create_file("reset", S_IWUSR, sswap_debugfs_root, NULL,
+                      &sswap_reset_fops);
+  return 0;
+}
+
+static void sswap_zfree(void)
+{
+  struct sswap_dentry *de, *tmp;
+  int cpu;
+
+  if (sswap_ztfm) {
+    for_each_possible_cpu(cpu)
+      if (!IS_ERR_OR_NULL(*per_cpu_ptr(sswap_ztfm, cpu)))
+        crypto_free_comp(*per_cpu_ptr(sswap_ztfm, cpu));
+    free_percpu(sswap_ztfm);
+  }
+  if (sswap_zbuf) {
+    for_each_possible_cpu(cpu)
+      kfree(*per_cpu_ptr(sswap_zbuf, cpu));
+    free_percpu(sswap_zbuf);
+  }
+  vfree(sswap_zentries);
+  vfree(sswap_zslots);
+  vfree(sswap_zrefs);
+  vfree(sswap_zowner);
+  rbtree_postorder_for_each_entry_safe(de, tmp, &sswap_dedup_index, node)
+    kfree(de);
+  vfree(sswap_zhash);
+  mempool_destroy(sswap_zpending_pool);
+  mempool_destroy(sswap_zbounce_pool);
+  if (!IS_ERR_OR_NULL(sswap_dedup_tfm))
+    crypto_free_shash(sswap_dedup_tfm);
+}
+
+static void sswap_vfree(void)
+{
+  struct sswap_ventry *ve, *tmp;
+
+  list_for_each_entry_safe(ve, tmp, &sswap_vlru, lru) {
+    radix_tree_delete(&sswap_vtree, ve->pageid);
+    kfree(ve);
+  }
+  zs_destroy_pool(sswap_vpool);
+}
+
+/* the per-cpu compressors, shared by the compression stage and the victim
+ * tier. freed by sswap_zfree() */
+static int __init sswap_comp_init(void)
+{
+  struct crypto_comp *tfm;
+  int cpu;
+
+  if (!crypto_has_comp(compressor, 0, 0)) {
+    pr_err("compressor %s is not available\n", compressor);
+    return -ENOENT;
+  }
+
+  sswap_ztfm = alloc_percpu(struct crypto_comp *);
+  sswap_zbuf = alloc_percpu(u8 *);
+  if (!sswap_ztfm || !sswap_zbuf)
+    return -ENOMEM;
+
+  for_each_possible_cpu(cpu) {
+    tfm = crypto_alloc_comp(compressor, 0, 0);
+    *per_cpu_ptr(sswap_ztfm, cpu) = tfm;
+    if (IS_ERR(tfm))
+      return PTR_ERR(tfm);
+    *per_cpu_ptr(sswap_zbuf, cpu) = kmalloc_node(SSWAP_ZBUF_SIZE, GFP_KERNEL,
+                                                 cpu_to_node(cpu));
+    if (!*per_cpu_ptr(sswap_zbuf, cpu))
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static int __init sswap_zinit(void)
+{
+  if (!remote_pages)
+    remote_pages = max_pages;
+  if (remote_pages >= SSWAP_ZSLOT_NONE)
+    return -EINVAL;
+
+  sswap_zentries = vzalloc(max_pages * sizeof(*sswap_zentries));
+  sswap_zslots = vzalloc(BITS_TO_LONGS(remote_pages) * sizeof(long));
+  sswap_zrefs = vzalloc(remote_pages * sizeof(*sswap_zrefs));
+  sswap_zowner = vzalloc(remote_pages);
+  if (!sswap_zentries || !sswap_zslots || !sswap_zrefs || !sswap_zowner)
+    return -ENOMEM;
+
+  sswap_zpending_pool = mempool_create_kmalloc_pool(
+      SSWAP_ZPENDING_RESERVE * num_possible_cpus(),
+      sizeof(struct sswap_zpending));
+  sswap_zbounce_pool = mempool_create_page_pool(
+      SSWAP_ZPENDING_RESERVE * num_possible_cpus(), 0);
+  if (!sswap_zpending_pool || !sswap_zbounce_pool)
+    return -ENOMEM;
+
+  if (dedup) {
+    sswap_dedup_tfm = crypto_alloc_shash("crc32c", 0, 0);
+    if (IS_ERR(sswap_dedup_tfm)) {
+      pr_err("crc32c is not available for dedup\n");
+      return PTR_ERR(sswap_dedup_tfm);
+    }
+    sswap_zhash = vzalloc(max_pages * sizeof(*sswap_zhash));
+    if (!sswap_zhash)
+      return -ENOMEM;
+  }
+
+  pr_info("compressing with %s into %lu remote pages\n", compressor,
+          remote_pages);
   return 0;
 }
 
 static int __init init_sswap(void)
 {
+  int ret;
+
+  sswap_owner = vzalloc(max_pages);
+  sswap_ra_owner = vzalloc(max_pages);
+  if (!sswap_owner || !sswap_ra_owner) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+
+  if (compress || dedup || victim_pages) {
+    ret = sswap_comp_init();
+    if (ret)
+      goto fail;
+  }
+  if (compress || dedup) {
+    ret = sswap_zinit();
+    if (ret)
+      goto fail;
+  }
+  if (victim_pages) {
+    sswap_vpool = zs_create_pool("fastswap");
+    if (!sswap_vpool) {
+      ret = -ENOMEM;
+      goto fail;
+    }
+    pr_info("keeping up to %lu pages of compressed pages locally\n",
+            victim_pages);
+  }
+
+  frontswap_keep_clean(keep_clean);
+  swapin_readahead_vma(vma_readahead);
+  swapin_fault_around(fault_around);
   frontswap_register_ops(&sswap_frontswap_ops);
   if (sswap_init_debugfs())
     pr_err("sswap debugfs failed\n");
 
   pr_info("sswap module loaded\n");
   return 0;
+
+fail:
+  sswap_zfree();
+  vfree(sswap_ra_owner);
+  vfree(sswap_owner);
+  return ret;
 }
 
 static void __exit exit_sswap(void)
 {
+  int i;
+
   pr_info("unloading sswap\n");
+  frontswap_keep_clean(false);
+  swapin_readahead_vma(false);
+  swapin_fault_around(false);
+  debugfs_remove_recursive(sswap_debugfs_root);
+  for (i = 0; i < SSWAP_MAX_BACKENDS; i++)
+    if (sswap_pinned[i])
+      module_put(sswap_backends[i]->owner);
+  kfree(rcu_dereference_protected(sswap_stack, 1));
+  vfree(sswap_owner);
+  vfree(sswap_ra_owner);
+  if (sswap_vpool)
+    sswap_vfree();
+  sswap_zfree();
 }
 
 module_init(init_sswap);
@@ -0,0 +1,41 @@
+#if !defined(_SSWAP_H)
+#define _SSWAP_H
+
+#include <linux/module.h>
+#include <linux/mm_types.h>
+
+/* the store returns before the page is remote, the backend ends writeback */
+#define SSWAP_CAP_ASYNC_STORE (1UL << 0)
+/* loads return before the page is read, poll_load waits for the demand
+ * read and the backend unlocks the page */
+#define SSWAP_CAP_ASYNC_LOAD  (1UL << 1)
+
+/* a far memory backend. fastswap routes frontswap to the backends named in
+ * its backend parameter and remembers which one holds every page, so
+ * backends can be switched and stacked at runtime.
+ *
+ * roffset is the byte offset of the page in far memory, its swap offset
+ * unless fastswap remaps it. pages may be fastswap's own rather than swap
+ * cache pages. store is called with the page under writeback and loads
+ * with the page locked, the backend ends the writeback and unlocks the
+ * page when it is done with them. a store that fails must leave the page
+ * under writeback, fastswap then tries the next backend. invalidate may
+ * be NULL. */
+struct sswap_backend_ops {
+  const char *name;
+  struct module *owner;
+  unsigned long caps; /* SSWAP_CAP_* */
+
+  int (*store)(struct page *page, u64 roffset);
+  int (*load_sync)(struct page *page, u64 roffset);
+  int (*load_async)(struct page *page, u64 roffset);
+  int (*poll_load)(int cpu);
+  void (*invalidate)(u64 roffset);
+
+  int slot; /* private to fastswap */
+};
+
+int sswap_register_backend(struct sswap_backend_ops *ops);
+void sswap_unregister_backend(struct sswap_backend_ops *ops);
+
+#endif
@@ -9,28 +9,27 @@
 
 static void *drambuf;
 
-int sswap_rdma_write(struct page *page, u64 roffset)
+static int sswap_dram_write(struct page *page, u64 roffset)
 {
 	void *page_vaddr;
 
+	VM_BUG_ON_PAGE(!PageWriteback(page), page);
+
+	/* past the buffer, let the next backend have it */
+	if (roffset >= REMOTE_BUF_SIZE)
+		return -ENOSPC;
+
 	page_vaddr = kmap_atomic(page);
 	copy_page((void *) (drambuf + roffset), page_vaddr);
 	kunmap_atomic(page_vaddr);
+	end_page_writeback(page);
 	return 0;
 }
-EXPORT_SYMBOL(sswap_rdma_write);
 
-int sswap_rdma_poll_load(int cpu)
-{
-	return 0;
-}
-EXPORT_SYMBOL(sswap_rdma_poll_load);
-
-int sswap_rdma_read_async(struct page *page, u64 roffset)
+static int sswap_dram_read_async(struct page *page, u64 roffset)
 {
 	void *page_vaddr;
 
-	VM_BUG_ON_PAGE(!PageSwapCache(page), page);
 	VM_BUG_ON_PAGE(!PageLocked(page), page);
 	VM_BUG_ON_PAGE(PageUptodate(page), page);
 
@@ -42,33 +41,40 @@ int sswap_rdma_read_async(struct page *page, u64 roffset)
 	unlock_page(page);
 	return 0;
 }
-EXPORT_SYMBOL(sswap_rdma_read_async);
 
-int sswap_rdma_read_sync(struct page *page, u64 roffset)
-{
-	return sswap_rdma_read_async(page, roffset);
-}
-EXPORT_SYMBOL(sswap_rdma_read_sync);
-
-int sswap_rdma_drain_loads_sync(int cpu, int target)
-{
-	return 1;
-}
-EXPORT_SYMBOL(sswap_rdma_drain_loads_sync);
+/* stores and loads are copies, done by the time they return */
+static struct sswap_backend_ops sswap_dram_backend = {
+	.name = "dram",
+	.owner = THIS_MODULE,
+	.store = sswap_dram_write,
+	.load_sync = sswap_dram_read_async,
+	.load_async = sswap_dram_read_async,
+};
 
 static void __exit sswap_dram_cleanup_module(void)
 {
+	sswap_unregister_backend(&sswap_dram_backend);
 	vfree(drambuf);
 }
 
 static int __init sswap_dram_init_module(void)
 {
+	int ret;
+
 	pr_info("start: %s\n", __FUNCTION__);
 	pr_info("will use new DRAM backend");
 
 	drambuf = vzalloc(REMOTE_BUF_SIZE);
+	if (!drambuf)
+		return -ENOMEM;
 	pr_info("vzalloc'ed %lu bytes for dram backend\n", REMOTE_BUF_SIZE);
 
+	ret = sswap_register_backend(&sswap_dram_backend);
+	if (ret) {
+		vfree(drambuf);
+		return ret;
+	}
+
 	pr_info("DRAM backend is ready for reqs\n");
 	return 0;
 }
@@ -3,12 +3,6 @@
 
 #include <linux/module.h>
 #include <linux/vmalloc.h>
-
-
-int sswap_rdma_read_async(struct page *page, u64 roffset);
-int sswap_rdma_read_sync(struct page *page, u64 roffset);
-int sswap_rdma_write(struct page *page, u64 roffset);
-int sswap_rdma_poll_load(int cpu);
-int sswap_rdma_drain_loads_sync(int cpu, int target);
+#include "fastswap.h"
 
 #endif
@@ -3,33 +3,215 @@
 #include "fastswap_rdma.h"
 #include <linux/slab.h>
 #include <linux/cpumask.h>
-
-static struct sswap_rdma_ctrl *gctrl;
-static int serverport;
-static int numqueues;
-static int numcpus;
-static char serverip[INET_ADDRSTRLEN];
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+#include <linux/cpuhotplug.h>
+#include <linux/srcu.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/wait.h>
+#include <linux/raid/pq.h>
+#include <linux/raid/xor.h>
+#include "fastswap_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "fastswap_trace.h"
+
+#define MAX_SERVERS 16
+#define EC_MAX_K 8
+
+/* one ctrl per memory server, each with its own queue sets */
+static struct sswap_rdma_ctrl *ctrls[MAX_SERVERS];
+static int nservers;
+static char *serverips[MAX_SERVERS];
+static int serverports[MAX_SERVERS];
+static int nports;
+static int stripe_pages = 64;
+static char *placement = "stripe";
+static int replicas = 1;
+static int write_quorum;
+static mempool_t *repl_pool;
+/* state of replicated slots, by slot. only slots with state have an
+ * entry: SLOT_BUSY while a store's writes are in flight, and above it the
+ * ctrl ids of the replicas that missed the slot's last store (stale, never
+ * read from). values are exceptional entries, lookups only need rcu */
+#define SLOT_BUSY 1UL
+#define SLOT_STALE_SHIFT 1
+static RADIX_TREE(repl_slots, GFP_ATOMIC);
+static DEFINE_SPINLOCK(repl_lock);
+static DECLARE_WAIT_QUEUE_HEAD(repl_wait);
+static int ec_k;
+static int ec_m = 2;
+static int ec_frag; /* bytes of a page per fragment */
+static mempool_t *ecread_pool;
+static mempool_t *parity_pool;
+static int numqueues; /* queue slots, NR_QP_TYPES per queue set */
+static int nr_qsets;
+static int max_qsets; /* queue set slots */
 static char clientip[INET_ADDRSTRLEN];
-static struct kmem_cache *req_cache;
-static atomic_t read_test_done;
-static atomic_t read_async_test_done; 
-static atomic_t write_test_done; 
-
-module_param_named(sport, serverport, int, 0644);
-module_param_named(nq, numqueues, int, 0644);
-module_param_string(sip, serverip, INET_ADDRSTRLEN, 0644);
+static bool async_writes = true;
+static int wr_batch = 32;
+static int poll_mode = 1;
+static int poll_window_ns = 1000;
+static int sleep_min_ns = 10000;
+static int irq_wait_ns = 50000;
+static char *cv_policy = "percpu";
+static int cv_set[NR_CPUS];
+static int cv_set_len;
+static char *numa_route = "local";
+static int reconnect_delay_ms = 100;
+static int prefetch_depth = 16;
+static struct workqueue_struct *recovery_wq;
+
+/* queue sets are created and torn down under qset_lock. Posters look up
+ * the set of their cpu in qmap and use it inside a qset_srcu read side
+ * section, so a set can be torn down once the map no longer points at it
+ * and a grace period passed. */
+static DEFINE_MUTEX(qset_lock);
+DEFINE_STATIC_SRCU(qset_srcu);
+/* queue set serving each cpu, -1 for none */
+static int *qmap;
+static unsigned long *live_qsets;
+static int cpuhp_state;
+static struct dentry *debugfs_root;
+static struct sswap_backend_ops sswap_rdma_backend;
+
+struct sswap_rdma_pcpu_stats {
+  u64 posts[NR_QP_TYPES];
+  u64 cqes[NR_QP_TYPES];
+  u64 errors[NR_QP_TYPES];
+  u64 backpressure[NR_QP_TYPES];
+  u64 doorbells[NR_QP_TYPES];
+  u64 poll_sleeps[NR_QP_TYPES];
+  u64 poll_irq_waits[NR_QP_TYPES];
+  u64 replays[NR_QP_TYPES];
+  u64 rebuilds[NR_QP_TYPES];
+  u64 deferrals[NR_QP_TYPES];
+  u64 failovers[NR_QP_TYPES];
+  /* post to completion */
+  struct sswap_hist lat[NR_QP_TYPES];
+};
+
+static DEFINE_PER_CPU(struct sswap_rdma_pcpu_stats, sswap_rdma_stats);
+
+static const char * const qp_type_names[] = {
+  "read_sync",
+  "read_async",
+  "write_sync",
+};
+
+module_param_array_named(sport, serverports, int, &nports, 0444);
+MODULE_PARM_DESC(sport, "port of each memory server, or one for all");
+module_param_named(nq, nr_qsets, int, 0444);
+MODULE_PARM_DESC(nq, "number of queue sets (a read sync, read async and "
+    "write queue) shared by all cpus, 0 gives every online cpu a set of its "
+    "own that follows cpu hotplug (default: 0)");
+module_param_array_named(sip, serverips, charp, &nservers, 0444);
+MODULE_PARM_DESC(sip, "comma separated ips of the memory servers that swap "
+    "is spread over");
+module_param(stripe_pages, int, 0444);
+MODULE_PARM_DESC(stripe_pages, "pages placed on one server before moving on "
+    "to the next, keeps readahead windows on one server (default: 64)");
+module_param(placement, charp, 0444);
+MODULE_PARM_DESC(placement, "maps swap offsets to servers: stripe "
+    "(default: stripe)");
+module_param(replicas, int, 0444);
+MODULE_PARM_DESC(replicas, "servers every page is written to, reads go to "
+    "the replica with the lowest expected latency (default: 1)");
+module_param(write_quorum, int, 0444);
+MODULE_PARM_DESC(write_quorum, "replica writes that end a store's "
+    "writeback, 0 waits for all of them (default: 0)");
+module_param(ec_k, int, 0444);
+MODULE_PARM_DESC(ec_k, "erasure code every page into ec_k data fragments "
+    "(2, 4 or 8) plus ec_m parity fragments on as many servers, 0 disables "
+    "(default: 0)");
+module_param(ec_m, int, 0444);
+MODULE_PARM_DESC(ec_m, "parity fragments per page with ec_k, 1 or 2 "
+    "(default: 2)");
 module_param_string(cip, clientip, INET_ADDRSTRLEN, 0644);
+module_param(async_writes, bool, 0444);
+MODULE_PARM_DESC(async_writes, "return from stores once the write is posted, "
+    "the page stays under writeback until its completion (default: true)");
+module_param(wr_batch, int, 0644);
+MODULE_PARM_DESC(wr_batch, "max wrs chained into one post while the caller "
+    "holds a block plug (readahead, reclaim), 1 disables (default: 32)");
+module_param(poll_mode, int, 0644);
+MODULE_PARM_DESC(poll_mode, "waiting on demand reads: 0 busy polls the cq, "
+    "1 sleeps or yields until the expected completion time and only polls "
+    "in the final window (default: 1)");
+module_param(poll_window_ns, int, 0644);
+MODULE_PARM_DESC(poll_window_ns, "adaptive polling: busy poll this long "
+    "before the expected completion (default: 1000)");
+module_param(sleep_min_ns, int, 0644);
+MODULE_PARM_DESC(sleep_min_ns, "adaptive polling: shortest wait worth "
+    "sleeping on an hrtimer, shorter ones yield (default: 10000)");
+module_param(irq_wait_ns, int, 0644);
+MODULE_PARM_DESC(irq_wait_ns, "adaptive polling: once the oldest wr is this "
+    "late, sleep until the completion interrupt (default: 50000)");
+module_param(cv_policy, charp, 0444);
+MODULE_PARM_DESC(cv_policy, "completion vector of each queue's cq: percpu "
+    "(the vector whose irq is on the queue's cpu), numa (spread over the "
+    "vectors on the queue's node) or fixed (round robin over cv_set) "
+    "(default: percpu)");
+module_param_array(cv_set, int, &cv_set_len, 0444);
+MODULE_PARM_DESC(cv_set, "completion vectors for cv_policy=fixed");
+module_param(numa_route, charp, 0444);
+MODULE_PARM_DESC(numa_route, "queues used by each cpu: local (its own) or "
+    "nic (cpus on other nodes than the nic share the queues of the cpus on "
+    "the nic's node, trading queue sharing for local pcie) (default: local)");
+
+module_param(reconnect_delay_ms, int, 0644);
+MODULE_PARM_DESC(reconnect_delay_ms, "delay before retrying a failed "
+    "reconnect after link loss, doubled on every retry up to 5s "
+    "(default: 100)");
+module_param(prefetch_depth, int, 0644);
+MODULE_PARM_DESC(prefetch_depth, "prefetch wrs a cpu keeps posted to a "
+    "server while a demand read to it is in flight, the others wait "
+    "unposted until it completes. 0 never holds prefetches back "
+    "(default: 16)");
+
+static inline int qset_idx(int set, enum qp_type type)
+{
+  return type * max_qsets + set;
+}
+
+enum cv_policy {
+  CV_PERCPU,
+  CV_NUMA,
+  CV_FIXED,
+};
+
+static enum cv_policy cv_policy_id;
 
 // TODO: destroy ctrl
 
 #define CONNECTION_TIMEOUT_MS 60000
+#define RECONNECT_MAX_DELAY_MS 5000
 #define QP_QUEUE_DEPTH 256
 /* we don't really use recv wrs, so any small number should do */
 #define QP_MAX_RECV_WR 4
 /* we mainly do send wrs */
 #define QP_MAX_SEND_WR	(4096)
-#define CQ_NUM_CQES	(QP_MAX_SEND_WR)
 #define POLL_BATCH_HIGH (QP_MAX_SEND_WR / 4)
+/* wcs polled at a time from direct cqs */
+#define POLL_BATCH 8
+
+/* send queue depth and request ring size of each queue type, powers of 2.
+ * demand reads have about one wr in flight per cpu, prefetches come in
+ * readahead windows and writes in reclaim batches */
+static const unsigned int queue_depth[NR_QP_TYPES] = {
+  [QP_READ_SYNC] = 64,
+  [QP_READ_ASYNC] = 512,
+  [QP_WRITE_SYNC] = 1024,
+};
 
 static void sswap_rdma_addone(struct ib_device *dev)
 {
@@ -87,9 +269,15 @@ out_err:
   return NULL;
 }
 
+static void sswap_rdma_start_recovery(struct sswap_rdma_ctrl *ctrl);
+
 static void sswap_rdma_qp_event(struct ib_event *e, void *c)
 {
-  pr_info("sswap_rdma_qp_event\n");
+  struct rdma_queue *q = c;
+
+  pr_info("sswap_rdma_qp_event: %s\n", ib_event_msg(e->event));
+  if (e->event == IB_EVENT_QP_FATAL && READ_ONCE(q->state) == QUEUE_LIVE)
+    sswap_rdma_start_recovery(q->ctrl);
 }
 
 static int sswap_rdma_create_qp(struct rdma_queue *queue)
@@ -102,7 +290,8 @@ static int sswap_rdma_create_qp(struct rdma_queue *queue)
 
   memset(&init_attr, 0, sizeof(init_attr));
   init_attr.event_handler = sswap_rdma_qp_event;
-  init_attr.cap.max_send_wr = QP_MAX_SEND_WR;
+  init_attr.qp_context = queue;
+  init_attr.cap.max_send_wr = queue->nreqs;
   init_attr.cap.max_recv_wr = QP_MAX_RECV_WR;
   init_attr.cap.max_recv_sge = 1;
   init_attr.cap.max_send_sge = 1;
@@ -123,33 +312,131 @@ static int sswap_rdma_create_qp(struct rdma_queue *queue)
   return ret;
 }
 
-static void sswap_rdma_destroy_queue_ib(struct rdma_queue *q)
+/* completion interrupt of a direct cq, armed by a waiter that expects a
+ * long wait */
+static void sswap_rdma_cq_event(struct ib_cq *cq, void *ctx)
 {
-  struct sswap_rdma_dev *rdev;
-  struct ib_device *ibdev;
+  struct rdma_queue *q = ctx;
 
-  pr_info("start: %s\n", __FUNCTION__);
+  atomic_inc(&q->cq_events);
+  wake_up(&q->cq_wait);
+}
+
+static void sswap_rdma_free_cq(struct rdma_queue *q)
+{
+  if (q->poll_ctx == IB_POLL_DIRECT)
+    ib_destroy_cq(q->cq);
+  else
+    ib_free_cq(q->cq);
+  q->cq = NULL;
+}
+
+static inline int sswap_rdma_dev_node(struct ib_device *ibdev)
+{
+  return dev_to_node(ibdev->dev.parent);
+}
+
+/* the ib core doesn't tell us where a vector's irq goes, but mlx4 and
+ * mlx5 set the affinity hint of vector i to cpumask_local_spread(i, node)
+ * of the device node. Assumes irqbalance leaves those hints alone. */
+static int sswap_rdma_vector_cpu(struct ib_device *ibdev, int vector)
+{
+  return cpumask_local_spread(vector, sswap_rdma_dev_node(ibdev));
+}
+
+static int sswap_rdma_comp_vector(struct rdma_queue *q)
+{
+  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  int nvec = ibdev->num_comp_vectors;
+  int node = cpu_to_node(q->cpu);
+  int v, nlocal = 0, pick;
+
+  if (nvec <= 1)
+    return 0;
+
+  switch (cv_policy_id) {
+  case CV_FIXED:
+    return cv_set[q->cpu % cv_set_len] % nvec;
+  case CV_NUMA:
+    for (v = 0; v < nvec; v++)
+      if (cpu_to_node(sswap_rdma_vector_cpu(ibdev, v)) == node)
+        nlocal++;
+    if (!nlocal)
+      break;
+
+    pick = q->cpu % nlocal;
+    for (v = 0; v < nvec; v++)
+      if (cpu_to_node(sswap_rdma_vector_cpu(ibdev, v)) == node && !pick--)
+        return v;
+    break;
+  case CV_PERCPU:
+    for (v = 0; v < nvec; v++)
+      if (sswap_rdma_vector_cpu(ibdev, v) == q->cpu)
+        return v;
+    break;
+  }
+
+  return q->cpu % nvec;
+}
+
+static int sswap_rdma_parse_cv_policy(void)
+{
+  int i;
 
-  rdev = q->ctrl->rdev;
-  ibdev = rdev->dev;
-  //rdma_destroy_qp(q->ctrl->cm_id);
-  ib_free_cq(q->cq);
+  if (!strcmp(cv_policy, "percpu")) {
+    cv_policy_id = CV_PERCPU;
+  } else if (!strcmp(cv_policy, "numa")) {
+    cv_policy_id = CV_NUMA;
+  } else if (!strcmp(cv_policy, "fixed")) {
+    if (!cv_set_len) {
+      pr_err("cv_policy=fixed needs cv_set\n");
+      return -EINVAL;
+    }
+    for (i = 0; i < cv_set_len; i++) {
+      if (cv_set[i] < 0) {
+        pr_err("invalid completion vector %d in cv_set\n", cv_set[i]);
+        return -EINVAL;
+      }
+    }
+    cv_policy_id = CV_FIXED;
+  } else {
+    pr_err("unknown cv_policy %s\n", cv_policy);
+    return -EINVAL;
+  }
+
+  return 0;
 }
 
 static int sswap_rdma_create_queue_ib(struct rdma_queue *q)
 {
   struct ib_device *ibdev = q->ctrl->rdev->dev;
   int ret;
-  int comp_vector = 0;
+  int comp_vector = sswap_rdma_comp_vector(q);
 
   pr_info("start: %s\n", __FUNCTION__);
 
-  if (q->qp_type == QP_READ_ASYNC)
-    q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
+  /* a reconnect keeps the cq, pollers may still be on it */
+  if (q->cq)
+    return sswap_rdma_create_qp(q);
+
+  /* async queues have their completions reaped in batches from softirq.
+   * the others are polled by whoever waits on them, with a completion
+   * handler of our own for the adaptive polling fallback */
+  if (q->qp_type == QP_READ_ASYNC ||
+      (q->qp_type == QP_WRITE_SYNC && async_writes)) {
+    q->poll_ctx = IB_POLL_SOFTIRQ;
+    q->cq = ib_alloc_cq(ibdev, q, q->nreqs + QP_MAX_RECV_WR,
       comp_vector, IB_POLL_SOFTIRQ);
-  else
-    q->cq = ib_alloc_cq(ibdev, q, CQ_NUM_CQES,
-      comp_vector, IB_POLL_DIRECT);
+  } else {
+    struct ib_cq_init_attr cq_attr = {
+      .cqe = q->nreqs + QP_MAX_RECV_WR,
+      .comp_vector = comp_vector,
+    };
+
+    q->poll_ctx = IB_POLL_DIRECT;
+    q->cq = ib_create_cq(ibdev, sswap_rdma_cq_event, NULL, q, &cq_attr);
+  }
+  q->comp_vector = comp_vector;
 
   if (IS_ERR(q->cq)) {
     ret = PTR_ERR(q->cq);
@@ -163,8 +450,9 @@ static int sswap_rdma_create_queue_ib(struct rdma_queue *q)
   return 0;
 
 out_destroy_ib_cq:
-  ib_free_cq(q->cq);
+  sswap_rdma_free_cq(q);
 out_err:
+  q->cq = NULL;
   return ret;
 }
 
@@ -181,18 +469,24 @@ static int sswap_rdma_addr_resolved(struct rdma_queue *q)
     return -ENODEV;
   }
 
+  /* cqs, pd and dma mappings of in-flight pages belong to the device */
+  if (q->cm_id->device != rdev->dev) {
+    pr_err("route moved to device %s\n", q->cm_id->device->name);
+    return -ENODEV;
+  }
+
   ret = sswap_rdma_create_queue_ib(q);
   if (ret) {
     return ret;
   }
 
+  /* on failure the qp goes with the cm id in sswap_rdma_connect_queue(),
+   * the cq stays: pollers may still be on it */
   ret = rdma_resolve_route(q->cm_id, CONNECTION_TIMEOUT_MS);
-  if (ret) {
-    pr_err("rdma_resolve_route failed\n");
-    sswap_rdma_destroy_queue_ib(q);
-  }
+  if (ret)
+    pr_err("rdma_resolve_route failed: %d\n", ret);
 
-  return 0;
+  return ret;
 }
 
 static int sswap_rdma_route_resolved(struct rdma_queue *q,
@@ -215,17 +509,31 @@ static int sswap_rdma_route_resolved(struct rdma_queue *q,
       q->ctrl->rdev->dev->attrs.max_qp_init_rd_atom);
 
   ret = rdma_connect(q->cm_id, &param);
-  if (ret) {
+  if (ret)
     pr_err("rdma_connect failed (%d)\n", ret);
-    sswap_rdma_destroy_queue_ib(q);
-  }
 
-  return 0;
+  return ret;
 }
 
-static int sswap_rdma_conn_established(struct rdma_queue *q)
+/* the server accepts every queue with its memory region as private data */
+static int sswap_rdma_conn_established(struct rdma_queue *q,
+    struct rdma_conn_param *conn)
 {
-  pr_info("connection established\n");
+  struct sswap_rdma_ctrl *ctrl = q->ctrl;
+  const struct sswap_rdma_memregion *mr = conn->private_data;
+
+  if (!mr || conn->private_data_len < sizeof(*mr)) {
+    pr_err("no memory region from server\n");
+    return -EPROTO;
+  }
+
+  if (ctrl->servermr.key && (ctrl->servermr.baseaddr != mr->baseaddr ||
+                             ctrl->servermr.key != mr->key))
+    pr_err("server memory region changed, swapped out pages are lost\n");
+
+  ctrl->servermr = *mr;
+  pr_info("connection established, servermr baseaddr=%llx, key=%u\n",
+          ctrl->servermr.baseaddr, ctrl->servermr.key);
   return 0;
 }
 
@@ -246,7 +554,7 @@ static int sswap_rdma_cm_handler(struct rdma_cm_id *cm_id,
     cm_error = sswap_rdma_route_resolved(queue, &ev->param.conn);
     break;
   case RDMA_CM_EVENT_ESTABLISHED:
-    queue->cm_error = sswap_rdma_conn_established(queue);
+    queue->cm_error = sswap_rdma_conn_established(queue, &ev->param.conn);
     /* complete cm_done regardless of success/failure */
     complete(&queue->cm_done);
     return 0;
@@ -262,8 +570,11 @@ static int sswap_rdma_cm_handler(struct rdma_cm_id *cm_id,
     break;
   case RDMA_CM_EVENT_DISCONNECTED:
   case RDMA_CM_EVENT_ADDR_CHANGE:
-  case RDMA_CM_EVENT_TIMEWAIT_EXIT:
     pr_err("CM connection closed %d\n", ev->event);
+    if (READ_ONCE(queue->state) == QUEUE_LIVE)
+      sswap_rdma_start_recovery(queue->ctrl);
+    break;
+  case RDMA_CM_EVENT_TIMEWAIT_EXIT:
     break;
   case RDMA_CM_EVENT_DEVICE_REMOVAL:
     /* device removal is handled via the ib_client API */
@@ -288,21 +599,14 @@ inline static int sswap_rdma_wait_for_cm(struct rdma_queue *queue)
   return queue->cm_error;
 }
 
-static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl,
-    int idx)
+/* resolves, connects and waits for the queue, reusing its cq if it has
+ * one */
+static int sswap_rdma_connect_queue(struct sswap_rdma_ctrl *ctrl,
+    struct rdma_queue *queue)
 {
-  struct rdma_queue *queue;
   int ret;
 
-  pr_info("start: %s\n", __FUNCTION__);
-
-  queue = &ctrl->queues[idx];
-  queue->ctrl = ctrl;
   init_completion(&queue->cm_done);
-  atomic_set(&queue->pending, 0);
-  spin_lock_init(&queue->cq_lock);
-  queue->qp_type = get_queue_type(idx);
-
   queue->cm_id = rdma_create_id(&init_net, sswap_rdma_cm_handler, queue,
       RDMA_PS_TCP, IB_QPT_RC);
   if (IS_ERR(queue->cm_id)) {
@@ -328,619 +632,2318 @@ static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl,
   return 0;
 
 out_destroy_cm_id:
+  if (queue->cm_id->qp)
+    rdma_destroy_qp(queue->cm_id);
   rdma_destroy_id(queue->cm_id);
   return ret;
 }
 
-static void sswap_rdma_stop_queue(struct rdma_queue *q)
+static int sswap_rdma_init_queue(struct sswap_rdma_ctrl *ctrl, int set,
+    enum qp_type type, int cpu)
 {
-  rdma_disconnect(q->cm_id);
-}
+  struct rdma_queue *queue = ctrl->queues[qset_idx(set, type)];
+  int node = cpu_to_node(cpu);
+  int ret;
 
-static void sswap_rdma_free_queue(struct rdma_queue *q)
-{
-  rdma_destroy_qp(q->cm_id);
-  ib_free_cq(q->cq);
-  rdma_destroy_id(q->cm_id);
-}
+  pr_info("start: %s\n", __FUNCTION__);
 
-static int sswap_rdma_init_queues(struct sswap_rdma_ctrl *ctrl)
-{
-  int ret, i;
-  pr_info("numqueues: %d\n", numqueues);
-  for (i = 0; i < numqueues; ++i) {
-    ret = sswap_rdma_init_queue(ctrl, i);
-    if (ret) {
-      pr_err("failed to initialized queue: %d\n", i);
-      goto out_free_queues;
+  /* queue and ring are only touched by the cpus the queue serves. A torn
+   * down set keeps them for when it is created again */
+  if (!queue) {
+    queue = kzalloc_node(sizeof(*queue), GFP_KERNEL, node);
+    if (!queue)
+      return -ENOMEM;
+
+    queue->nreqs = queue_depth[type];
+    queue->reqs = vzalloc_node(sizeof(struct rdma_req) * queue->nreqs, node);
+    if (!queue->reqs) {
+      pr_err("no memory for request ring\n");
+      kfree(queue);
+      return -ENOMEM;
     }
+    spin_lock_init(&queue->ring_lock);
+    init_llist_head(&queue->batch);
+    spin_lock_init(&queue->cq_lock);
+    init_waitqueue_head(&queue->cq_wait);
+    ctrl->queues[qset_idx(set, type)] = queue;
   }
 
+  queue->ctrl = ctrl;
+  atomic_set(&queue->pending, 0);
+  atomic_set(&queue->inflight, 0);
+  atomic_set(&queue->nbatch, 0);
+  atomic_set(&queue->deferred, 0);
+  atomic_set(&queue->cq_events, 0);
+  queue->lat_ewma = 0;
+  queue->qp_type = type;
+  queue->cpu = cpu;
+  queue->req_head = 0;
+  queue->req_tail = 0;
+  init_llist_head(&queue->failed);
+
+  ret = sswap_rdma_connect_queue(ctrl, queue);
+  if (ret)
+    return ret;
+
+  WRITE_ONCE(queue->state, QUEUE_LIVE);
   return 0;
+}
 
-out_free_queues:
-  for (i--; i >= 0; i--) {
-    sswap_rdma_stop_queue(&ctrl->queues[i]);
-    sswap_rdma_free_queue(&ctrl->queues[i]);
-  }
+static void sswap_rdma_drain_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+  struct rdma_req *marker = container_of(wc->wr_cqe, struct rdma_req, cqe);
 
-  return ret;
+  complete(&marker->done);
 }
 
-static void sswap_rdma_stopandfree_queues(struct sswap_rdma_ctrl *ctrl)
+static void sswap_rdma_wait_completion(struct rdma_queue *q,
+                                       struct rdma_req *qe);
+
+static void sswap_rdma_stop_queue(struct rdma_queue *q)
 {
-  int i;
-  pr_info("numqueues: %d\n", numqueues);
-  for (i = 0; i < numqueues; ++i) {
-    sswap_rdma_stop_queue(&ctrl->queues[i]);
-    sswap_rdma_free_queue(&ctrl->queues[i]);
-  }
+  /* our own disconnect doesn't start a recovery */
+  WRITE_ONCE(q->state, QUEUE_CLOSED);
+  rdma_disconnect(q->cm_id);
 }
 
-static int sswap_rdma_parse_ipaddr(struct sockaddr_in *saddr, char *ip)
+static void sswap_rdma_free_queue_ib(struct rdma_queue *q)
 {
-  u8 *addr = (u8 *)&saddr->sin_addr.s_addr;
-  size_t buflen = strlen(ip);
-
-  pr_info("start: %s\n", __FUNCTION__);
-
-  if (buflen > INET_ADDRSTRLEN)
-    return -EINVAL;
-  if (in4_pton(ip, buflen, addr, '\0', NULL) == 0)
-    return -EINVAL;
-  saddr->sin_family = AF_INET;
-  return 0;
+  rdma_destroy_qp(q->cm_id);
+  sswap_rdma_free_cq(q);
+  rdma_destroy_id(q->cm_id);
 }
 
-static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c)
+/* puts the qp in error and waits until the cqes of every wr posted on it
+ * were handled, like ib_drain_sq() which doesn't do direct cqs */
+static void sswap_rdma_drain_qp(struct rdma_queue *q)
 {
+  struct ib_qp_attr attr = { .qp_state = IB_QPS_ERR };
+  struct rdma_req marker = {};
+  struct ib_rdma_wr wr = {};
+  struct ib_send_wr *bad_wr;
   int ret;
-  struct sswap_rdma_ctrl *ctrl;
-  pr_info("will try to connect to %s:%d\n", serverip, serverport);
 
-  *c = kzalloc(sizeof(struct sswap_rdma_ctrl), GFP_KERNEL);
-  if (!*c) {
-    pr_err("no mem for ctrl\n");
-    return -ENOMEM;
+  if (q->poll_ctx != IB_POLL_DIRECT) {
+    ib_drain_sq(q->qp);
+    return;
   }
-  ctrl = *c;
 
-  pr_info("numqueues: %d\n", numqueues);
-  ctrl->queues = kzalloc(sizeof(struct rdma_queue) * numqueues, GFP_KERNEL);
-  ret = sswap_rdma_parse_ipaddr(&(ctrl->addr_in), serverip);
+  ret = ib_modify_qp(q->qp, &attr, IB_QP_STATE);
   if (ret) {
-    pr_err("sswap_rdma_parse_ipaddr failed: %d\n", ret);
-    return -EINVAL;
+    pr_err("failed to move qp to error: %d\n", ret);
+    return;
   }
-  ctrl->addr_in.sin_port = cpu_to_be16(serverport);
 
-  ret = sswap_rdma_parse_ipaddr(&(ctrl->srcaddr_in), clientip);
+  init_completion(&marker.done);
+  marker.cqe.done = sswap_rdma_drain_done;
+  wr.wr.wr_cqe = &marker.cqe;
+  wr.wr.opcode = IB_WR_RDMA_WRITE;
+  wr.wr.send_flags = IB_SEND_SIGNALED;
+  ret = ib_post_send(q->qp, &wr.wr, &bad_wr);
   if (ret) {
-    pr_err("sswap_rdma_parse_ipaddr failed: %d\n", ret);
-    return -EINVAL;
+    pr_err("failed to post drain marker: %d\n", ret);
+    return;
   }
-  /* no need to set the port on the srcaddr */
 
-  return sswap_rdma_init_queues(ctrl);
+  sswap_rdma_wait_completion(q, &marker);
 }
 
-static void __exit sswap_rdma_cleanup_module(void)
+static void sswap_rdma_free_queue(struct rdma_queue *q)
 {
-  sswap_rdma_stopandfree_queues(gctrl);
-  ib_unregister_client(&sswap_rdma_ib_client);
-  kfree(gctrl);
-  gctrl = NULL;
-  if (req_cache) {
-    kmem_cache_destroy(req_cache);
-  }
+  if (q->cq)
+    sswap_rdma_free_cq(q);
+  vfree(q->reqs);
+  kfree(q);
 }
 
-static void sswap_rdma_write_done(struct ib_cq *cq, struct ib_wc *wc)
+/* every server has the same sets, homed on the same cpus */
+static inline int sswap_rdma_qset_cpu(int set)
 {
-  pr_info("sswap_rdma_write_done! device:%s\n",cq->device->name);
-  struct rdma_req *req =
-    container_of(wc->wr_cqe, struct rdma_req, cqe);
-  struct rdma_queue *q = cq->cq_context;
-  struct ib_device *ibdev = q->ctrl->rdev->dev;
-
-  if (unlikely(wc->status != IB_WC_SUCCESS)) {
-    pr_err("sswap_rdma_write_done status is not success, it is=%d\n", wc->status);
-    //q->write_error = wc->status;
-  }
-  ib_dma_unmap_page(ibdev, req->dma, PAGE_SIZE, DMA_TO_DEVICE);
-
-  atomic_dec(&q->pending);
-  kmem_cache_free(req_cache, req);
+  return ctrls[0]->queues[qset_idx(set, QP_READ_SYNC)]->cpu;
 }
 
-static void sswap_rdma_read_done(struct ib_cq *cq, struct ib_wc *wc)
+/* the device of the first server decides numa placement */
+static inline int sswap_rdma_nic_node(void)
 {
-  pr_info("sswap_rdma_read_done!\n");
-  struct rdma_req *req =
-    container_of(wc->wr_cqe, struct rdma_req, cqe);
-  struct rdma_queue *q = cq->cq_context;
-  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  if (!ctrls[0]->rdev || strcmp(numa_route, "nic"))
+    return NUMA_NO_NODE;
 
-  if (unlikely(wc->status != IB_WC_SUCCESS))
-    pr_err("sswap_rdma_read_done status is not success, it is=%d\n", wc->status);
-
-  ib_dma_unmap_page(ibdev, req->dma, PAGE_SIZE, DMA_FROM_DEVICE);
-
-  SetPageUptodate(req->page);
-  unlock_page(req->page);
-  complete(&req->done);
-  atomic_dec(&q->pending);
-  kmem_cache_free(req_cache, req);
+  return sswap_rdma_dev_node(ctrls[0]->rdev->dev);
 }
 
-inline static int sswap_rdma_post_rdma(struct rdma_queue *q, struct rdma_req *qe,
-  struct ib_sge *sge, u64 roffset, enum ib_wr_opcode op)
+static int sswap_rdma_count_qsets(int node)
 {
-  pr_info("start: %s\n", __FUNCTION__);
-  struct ib_send_wr *bad_wr;
-  struct ib_rdma_wr rdma_wr = {};
-  int ret;
-
-  BUG_ON(qe->dma == 0);
-
-  sge->addr = qe->dma;
-  sge->length = PAGE_SIZE;
-  sge->lkey = q->ctrl->rdev->pd->local_dma_lkey;
-
-  /* TODO: add a chain of WR, we already have a list so should be easy
-   * to just post requests in batches */
-  rdma_wr.wr.next    = NULL;
-  rdma_wr.wr.wr_cqe  = &qe->cqe;
-  rdma_wr.wr.sg_list = sge;
-  rdma_wr.wr.num_sge = 1;
-  rdma_wr.wr.opcode  = op;
-  rdma_wr.wr.send_flags = IB_SEND_SIGNALED;
-  rdma_wr.remote_addr = q->ctrl->servermr.baseaddr + roffset;
-  rdma_wr.rkey = q->ctrl->servermr.key;
-
-  atomic_inc(&q->pending);
-  ret = ib_post_send(q->qp, &rdma_wr.wr, &bad_wr);
-  if (unlikely(ret)) {
-    pr_err("ib_post_send failed: %d\n", ret);
-  }
+  int set, n = 0;
 
-  struct ib_wc wc;
-  while(0 == ib_poll_cq(q->qp, 1, &wc));
-  pr_info("wc.status after send RDMA_WRITE is %d\n",wc.status);
-  
+  for_each_set_bit(set, live_qsets, max_qsets)
+    if (node == NUMA_NO_NODE || cpu_to_node(sswap_rdma_qset_cpu(set)) == node)
+      n++;
 
-  return ret;
+  return n;
 }
 
-static void sswap_rdma_recv_remotemr_done(struct ib_cq *cq, struct ib_wc *wc)
+/* maps every possible cpu to a live queue set: its own if it has one,
+ * otherwise spread over the sets on its node (on the nic's node with
+ * numa_route=nic), or over all sets if that node has none. caller holds
+ * qset_lock */
+static void sswap_rdma_update_qmap(void)
 {
-  struct rdma_req *qe =
-    container_of(wc->wr_cqe, struct rdma_req, cqe);
-  struct rdma_queue *q = cq->cq_context;
-  struct sswap_rdma_ctrl *ctrl = q->ctrl;
-  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  int nic_node = sswap_rdma_nic_node();
+  int cpu, c, s, set, node, n, pick;
+
+  for_each_possible_cpu(cpu) {
+    node = cpu_to_node(cpu);
+    if (nic_node != NUMA_NO_NODE && sswap_rdma_count_qsets(nic_node))
+      node = nic_node;
+    n = sswap_rdma_count_qsets(node);
+    if (!n) {
+      node = NUMA_NO_NODE;
+      n = sswap_rdma_count_qsets(node);
+    }
+    if (!n) {
+      WRITE_ONCE(qmap[cpu], -1);
+      continue;
+    }
 
-  if (unlikely(wc->status != IB_WC_SUCCESS)) {
-    pr_err("sswap_rdma_recv_done status is not success\n");
-    return;
-  }
-  ib_dma_unmap_single(ibdev, qe->dma, sizeof(struct sswap_rdma_memregion),
-		      DMA_FROM_DEVICE);
-  pr_info("my_device:%s servermr baseaddr=%llx, key=%u\n",cq->device->name, ctrl->servermr.baseaddr,
-	  ctrl->servermr.key);
-  complete_all(&qe->done);
+    /* rank of cpu on its node, so its cpus spread evenly */
+    pick = 0;
+    for_each_possible_cpu(c) {
+      if (c == cpu)
+        break;
+      if (cpu_to_node(c) == cpu_to_node(cpu))
+        pick++;
+    }
+    pick %= n;
+
+    set = -1;
+    for_each_set_bit(s, live_qsets, max_qsets) {
+      c = sswap_rdma_qset_cpu(s);
+      if (node != NUMA_NO_NODE && cpu_to_node(c) != node)
+        continue;
+      if (c == cpu) {
+        set = s;
+        break;
+      }
+      if (!pick-- && set < 0)
+        set = s;
+    }
 
+    WRITE_ONCE(qmap[cpu], set);
+  }
 }
 
-static int sswap_rdma_post_recv(struct rdma_queue *q, struct rdma_req *qe,
-  size_t bufsize)
+/* connects the queues of a set homed on cpu to one server */
+static int sswap_rdma_connect_qset(struct sswap_rdma_ctrl *ctrl, int set,
+    int cpu)
 {
-  struct ib_recv_wr *bad_wr;
-  struct ib_recv_wr wr = {};
-  struct ib_sge sge;
-  int ret;
+  struct rdma_queue *q;
+  int ret, t;
 
-  sge.addr = qe->dma;
-  sge.length = bufsize;
-  sge.lkey = q->ctrl->rdev->pd->local_dma_lkey;
+  mutex_lock(&ctrl->recovery_lock);
+  for (t = 0; t < NR_QP_TYPES; t++) {
+    ret = sswap_rdma_init_queue(ctrl, set, t, cpu);
+    if (ret) {
+      pr_err("failed to initialize queue %d of set %d\n", t, set);
+      goto out_free_queues;
+    }
+  }
+  mutex_unlock(&ctrl->recovery_lock);
 
-  wr.next    = NULL;
-  wr.wr_cqe  = &qe->cqe;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
+  return 0;
 
-  ret = ib_post_recv(q->qp, &wr, &bad_wr);
-  if (ret) {
-    pr_err("ib_post_recv failed: %d\n", ret);
+out_free_queues:
+  for (t--; t >= 0; t--) {
+    q = ctrl->queues[qset_idx(set, t)];
+    sswap_rdma_stop_queue(q);
+    sswap_rdma_free_queue_ib(q);
   }
+  mutex_unlock(&ctrl->recovery_lock);
+
   return ret;
 }
 
-/* allocates a sswap rdma request, creates a dma mapping for it in
- * req->dma, and synchronizes the dma mapping in the direction of
- * the dma map.
- * Don't touch the page with cpu after creating the request for it!
- * Deallocates the request if there was an error */
-inline static int get_req_for_page(struct rdma_req **req, struct ib_device *dev,
-				struct page *page, enum dma_data_direction dir)
+static void sswap_rdma_close_qset(struct sswap_rdma_ctrl *ctrl, int set)
 {
-  int ret;
-
-  ret = 0;
-  *req = kmem_cache_alloc(req_cache, GFP_ATOMIC);
-  if (unlikely(!req)) {
-    pr_err("no memory for req\n");
-    ret = -ENOMEM;
-    goto out;
-  }
-
-  (*req)->page = page;
-  init_completion(&(*req)->done);
+  struct rdma_queue *q;
+  int t;
 
-  (*req)->dma = ib_dma_map_page(dev, page, 0, PAGE_SIZE, dir);
-  if (unlikely(ib_dma_mapping_error(dev, (*req)->dma))) {
-    pr_err("ib_dma_mapping_error\n");
-    ret = -ENOMEM;
-    kmem_cache_free(req_cache, req);
-    goto out;
+  mutex_lock(&ctrl->recovery_lock);
+  for (t = 0; t < NR_QP_TYPES; t++) {
+    q = ctrl->queues[qset_idx(set, t)];
+    sswap_rdma_stop_queue(q);
+    sswap_rdma_free_queue_ib(q);
   }
-
-  ib_dma_sync_single_for_device(dev, (*req)->dma, PAGE_SIZE, dir);
-out:
-  return ret;
+  mutex_unlock(&ctrl->recovery_lock);
 }
 
-/* the buffer needs to come from kernel (not high memory) */
-inline static int get_req_for_buf(struct rdma_req **req, struct ib_device *dev,
-				void *buf, size_t size,
-				enum dma_data_direction dir)
+/* connects a set homed on cpu to every server. caller holds qset_lock */
+static int sswap_rdma_create_qset(int set, int cpu)
 {
-  int ret;
+  int ret, i;
 
-  ret = 0;
-  *req = kmem_cache_alloc(req_cache, GFP_ATOMIC);
-  if (unlikely(!req)) {
-    pr_err("no memory for req\n");
-    ret = -ENOMEM;
-    goto out;
+  for (i = 0; i < nservers; i++) {
+    ret = sswap_rdma_connect_qset(ctrls[i], set, cpu);
+    if (ret)
+      goto out_close;
   }
 
-  init_completion(&(*req)->done);
+  set_bit(set, live_qsets);
+  return 0;
 
-  (*req)->dma = ib_dma_map_single(dev, buf, size, dir);
-  if (unlikely(ib_dma_mapping_error(dev, (*req)->dma))) {
-    pr_err("ib_dma_mapping_error\n");
-    ret = -ENOMEM;
-    kmem_cache_free(req_cache, req);
-    goto out;
-  }
+out_close:
+  for (i--; i >= 0; i--)
+    sswap_rdma_close_qset(ctrls[i], set);
 
-  ib_dma_sync_single_for_device(dev, (*req)->dma, size, dir);
-out:
   return ret;
 }
 
-inline static void sswap_rdma_wait_completion(struct ib_cq *cq,
-					      struct rdma_req *qe)
+static void sswap_rdma_flush_batch(struct rdma_queue *q);
+static inline int drain_queue(struct rdma_queue *q);
+
+/* waits out every wr posted on q. direct cqs are polled from here, the
+ * task that posted a demand read may poll another set by now */
+static void sswap_rdma_quiesce_queue(struct rdma_queue *q)
 {
-  ndelay(1000);
-  while (!completion_done(&qe->done)) {
-    ndelay(250);
-    ib_process_cq_direct(cq, 1);
+  if (q->poll_ctx == IB_POLL_DIRECT) {
+    drain_queue(q);
+    return;
   }
+
+  sswap_rdma_flush_batch(q);
+  while (atomic_read(&q->pending) > 0)
+    msleep(1);
 }
 
-/* polls queue until we reach target completed wrs or qp is empty */
-static inline int poll_target(struct rdma_queue *q, int target)
+/* unmaps a set, waits for its users and in-flight wrs and disconnects
+ * it. The queue memory stays around: a plugged task may still hold an
+ * unplug callback for one of its queues, which then flushes an empty
+ * batch. caller holds qset_lock */
+static void sswap_rdma_destroy_qset(int set)
 {
-  unsigned long flags;
-  int completed = 0;
+  int i, t;
 
-  while (completed < target && atomic_read(&q->pending) > 0) {
-    spin_lock_irqsave(&q->cq_lock, flags);
-    completed += ib_process_cq_direct(q->cq, target - completed);
-    spin_unlock_irqrestore(&q->cq_lock, flags);
-    cpu_relax();
-  }
+  clear_bit(set, live_qsets);
+  sswap_rdma_update_qmap();
+  synchronize_srcu(&qset_srcu);
 
-  return completed;
+  for (i = 0; i < nservers; i++)
+    for (t = 0; t < NR_QP_TYPES; t++)
+      sswap_rdma_quiesce_queue(ctrls[i]->queues[qset_idx(set, t)]);
+  /* unplug callbacks that raced with the drain */
+  synchronize_srcu(&qset_srcu);
+
+  for (i = 0; i < nservers; i++)
+    sswap_rdma_close_qset(ctrls[i], set);
 }
 
-static inline int drain_queue(struct rdma_queue *q)
+/* with a set per cpu the set is created when the cpu comes online, before
+ * it runs any task. If that fails the cpu shares another set */
+static int sswap_rdma_cpu_online(unsigned int cpu)
 {
-  unsigned long flags;
+  mutex_lock(&qset_lock);
+  if (!test_bit(cpu, live_qsets) && sswap_rdma_create_qset(cpu, cpu))
+    pr_err("cpu %u shares a queue set\n", cpu);
+  sswap_rdma_update_qmap();
+  mutex_unlock(&qset_lock);
 
-  while (atomic_read(&q->pending) > 0) {
-    spin_lock_irqsave(&q->cq_lock, flags);
-    ib_process_cq_direct(q->cq, 16);
-    spin_unlock_irqrestore(&q->cq_lock, flags);
-    cpu_relax();
-  }
+  return 0;
+}
 
-  return 1;
+/* runs on the dying cpu before its tasks are migrated away, so they may
+ * still be using the set. Unmapping it first and the srcu grace period
+ * in sswap_rdma_destroy_qset() wait them out */
+static int sswap_rdma_cpu_offline(unsigned int cpu)
+{
+  mutex_lock(&qset_lock);
+  if (test_bit(cpu, live_qsets))
+    sswap_rdma_destroy_qset(cpu);
+  mutex_unlock(&qset_lock);
+
+  return 0;
 }
 
-static inline int write_queue_add(struct rdma_queue *q, struct page *page,
-				  u64 roffset)
+/* spreads the homes of shared sets over the online cpus, or over the
+ * nic's node with numa_route=nic once the device is known */
+static int sswap_rdma_qset_home(int set)
 {
-  struct rdma_req *req;
-  struct ib_device *dev = q->ctrl->rdev->dev;
-  struct ib_sge sge = {};
-  int ret, inflight;
+  return cpumask_local_spread(set, sswap_rdma_nic_node());
+}
 
-  while ((inflight = atomic_read(&q->pending)) >= QP_MAX_SEND_WR - 8) {
-    BUG_ON(inflight > QP_MAX_SEND_WR);
-    poll_target(q, 2048);
-    pr_info_ratelimited("back pressure writes");
+static int sswap_rdma_init_queues(void)
+{
+  int ret, set;
+
+  pr_info("queue sets: %d\n", nr_qsets);
+  if (!nr_qsets) {
+    ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "fastswap_rdma:online",
+                            sswap_rdma_cpu_online, sswap_rdma_cpu_offline);
+    if (ret < 0)
+      return ret;
+    cpuhp_state = ret;
+
+    if (bitmap_empty(live_qsets, max_qsets)) {
+      cpuhp_remove_state(cpuhp_state);
+      cpuhp_state = 0;
+      return -ENODEV;
+    }
+    return 0;
   }
 
-  ret = get_req_for_page(&req, dev, page, DMA_TO_DEVICE);
-  if (unlikely(ret))
-    return ret;
+  mutex_lock(&qset_lock);
+  for (set = 0; set < nr_qsets; ++set) {
+    ret = sswap_rdma_create_qset(set, sswap_rdma_qset_home(set));
+    if (ret)
+      goto out_destroy_qsets;
+  }
+  sswap_rdma_update_qmap();
+  mutex_unlock(&qset_lock);
 
-  req->cqe.done = sswap_rdma_write_done;
-  ret = sswap_rdma_post_rdma(q, req, &sge, roffset, IB_WR_RDMA_WRITE);
+  return 0;
+
+out_destroy_qsets:
+  for (set--; set >= 0; set--)
+    sswap_rdma_destroy_qset(set);
+  mutex_unlock(&qset_lock);
 
   return ret;
 }
 
-static inline int begin_read(struct rdma_queue *q, struct page *page,
-			     u64 roffset)
+static void sswap_rdma_stopandfree_queues(void)
 {
-  struct rdma_req *req;
-  struct ib_device *dev = q->ctrl->rdev->dev;
-  struct ib_sge sge = {};
-  int ret, inflight;
+  int i, s;
 
-  /* back pressure in-flight reads, can't send more than
-   * QP_MAX_SEND_WR at a time */
-  while ((inflight = atomic_read(&q->pending)) >= QP_MAX_SEND_WR) {
-    BUG_ON(inflight > QP_MAX_SEND_WR); /* only valid case is == */
-    poll_target(q, 8);
-    pr_info_ratelimited("back pressure happened on reads");
-  }
+  if (cpuhp_state > 0)
+    cpuhp_remove_state(cpuhp_state);
 
-  ret = get_req_for_page(&req, dev, page, DMA_TO_DEVICE);
-  if (unlikely(ret))
-    return ret;
+  mutex_lock(&qset_lock);
+  for_each_set_bit(i, live_qsets, max_qsets)
+    sswap_rdma_destroy_qset(i);
+  mutex_unlock(&qset_lock);
+
+  pr_info("numqueues: %d\n", numqueues);
+  for (s = 0; s < nservers; s++)
+    for (i = 0; i < numqueues; ++i)
+      if (ctrls[s]->queues[i])
+        sswap_rdma_free_queue(ctrls[s]->queues[i]);
+}
+
+static int sswap_rdma_parse_ipaddr(struct sockaddr_in *saddr, char *ip)
+{
+  u8 *addr = (u8 *)&saddr->sin_addr.s_addr;
+  size_t buflen = strlen(ip);
+
+  pr_info("start: %s\n", __FUNCTION__);
+
+  if (buflen > INET_ADDRSTRLEN)
+    return -EINVAL;
+  if (in4_pton(ip, buflen, addr, '\0', NULL) == 0)
+    return -EINVAL;
+  saddr->sin_family = AF_INET;
+  return 0;
+}
+
+static void sswap_rdma_start_recovery(struct sswap_rdma_ctrl *ctrl)
+{
+  if (cmpxchg(&ctrl->state, CTRL_LIVE, CTRL_RECOVERING) == CTRL_LIVE)
+    queue_work(recovery_wq, &ctrl->recovery_work);
+}
+
+/* posts the wrs lost with the link, then whatever was queued meanwhile */
+static void sswap_rdma_replay(struct rdma_queue *q)
+{
+  struct llist_node *nodes = llist_del_all(&q->failed);
+  struct rdma_req *req, *tmp;
+  int n = 0;
+
+  llist_for_each_entry_safe(req, tmp, nodes, lnode) {
+    llist_add(&req->lnode, &q->batch);
+    n++;
+  }
+  atomic_add(n, &q->nbatch);
+  this_cpu_add(sswap_rdma_stats.replays[q->qp_type], n);
+  sswap_rdma_flush_batch(q);
+}
+
+/* link loss recovery: stop posting, drain the old qps so that every lost
+ * wr is parked on its queue's failed list, reconnect with backoff (which
+ * also gets us the server mr again) and replay. Pollers keep their cqs
+ * and wait meanwhile, faults stall instead of failing */
+static void sswap_rdma_recovery_work(struct work_struct *work)
+{
+  struct sswap_rdma_ctrl *ctrl =
+    container_of(work, struct sswap_rdma_ctrl, recovery_work);
+  unsigned int delay = reconnect_delay_ms;
+  unsigned int noio_flags;
+  struct rdma_queue *q;
+  bool again = false;
+  int i, ret;
+
+  /* reclaim may wait on the writes we are about to replay, so the
+   * allocations of the reconnect must not recurse into io */
+  noio_flags = memalloc_noio_save();
+  mutex_lock(&ctrl->recovery_lock);
+  pr_err("link to server %d lost, reconnecting\n", ctrl->id);
+
+  for (i = 0; i < numqueues; i++) {
+    q = ctrl->queues[i];
+    if (q && q->state == QUEUE_LIVE)
+      WRITE_ONCE(q->state, QUEUE_DOWN);
+  }
+  synchronize_rcu();
+
+  for (i = 0; i < numqueues; i++) {
+    q = ctrl->queues[i];
+    if (!q || q->state != QUEUE_DOWN)
+      continue;
+    sswap_rdma_drain_qp(q);
+    rdma_destroy_qp(q->cm_id);
+    rdma_destroy_id(q->cm_id);
+  }
+
+  for (i = 0; i < numqueues; i++) {
+    q = ctrl->queues[i];
+    if (!q || q->state != QUEUE_DOWN)
+      continue;
+    while ((ret = sswap_rdma_connect_queue(ctrl, q))) {
+      pr_err("reconnecting queue %d failed: %d, retry in %ums\n", i, ret,
+             delay);
+      msleep(delay);
+      delay = min_t(unsigned int, delay * 2, RECONNECT_MAX_DELAY_MS);
+    }
+  }
+
+  for (i = 0; i < numqueues; i++) {
+    q = ctrl->queues[i];
+    if (!q || q->state != QUEUE_DOWN)
+      continue;
+    WRITE_ONCE(q->state, QUEUE_LIVE);
+    sswap_rdma_replay(q);
+  }
+
+  WRITE_ONCE(ctrl->state, CTRL_LIVE);
+  wake_up_all(&ctrl->live_wait);
+
+  /* wrs that failed again while we replayed */
+  for (i = 0; i < numqueues; i++) {
+    q = ctrl->queues[i];
+    if (q && !llist_empty(&q->failed))
+      again = true;
+  }
+  mutex_unlock(&ctrl->recovery_lock);
+  memalloc_noio_restore(noio_flags);
+
+  pr_info("link to server %d recovered\n", ctrl->id);
+  if (again)
+    sswap_rdma_start_recovery(ctrl);
+}
+
+static int sswap_rdma_create_ctrl(struct sswap_rdma_ctrl **c, int id)
+{
+  int ret;
+  struct sswap_rdma_ctrl *ctrl;
+  int port = serverports[nports == 1 ? 0 : id];
+
+  pr_info("will try to connect to %s:%d\n", serverips[id], port);
+
+  *c = kzalloc(sizeof(struct sswap_rdma_ctrl), GFP_KERNEL);
+  if (!*c) {
+    pr_err("no mem for ctrl\n");
+    return -ENOMEM;
+  }
+  ctrl = *c;
+  ctrl->id = id;
+  init_waitqueue_head(&ctrl->live_wait);
+  INIT_WORK(&ctrl->recovery_work, sswap_rdma_recovery_work);
+  mutex_init(&ctrl->recovery_lock);
+
+  pr_info("numqueues: %d\n", numqueues);
+  /* sparse so that sets can come and go with cpus */
+  ctrl->queues = kcalloc(numqueues, sizeof(struct rdma_queue *), GFP_KERNEL);
+  if (!ctrl->queues)
+    return -ENOMEM;
+  ret = sswap_rdma_parse_ipaddr(&(ctrl->addr_in), serverips[id]);
+  if (ret) {
+    pr_err("sswap_rdma_parse_ipaddr failed: %d\n", ret);
+    return -EINVAL;
+  }
+  ctrl->addr_in.sin_port = cpu_to_be16(port);
+
+  ret = sswap_rdma_parse_ipaddr(&(ctrl->srcaddr_in), clientip);
+  if (ret) {
+    pr_err("sswap_rdma_parse_ipaddr failed: %d\n", ret);
+    return -EINVAL;
+  }
+  /* no need to set the port on the srcaddr */
+
+  return 0;
+}
+
+static int sswap_rdma_stats_show(struct seq_file *m, void *v)
+{
+  struct sswap_rdma_pcpu_stats sum = {};
+  int cpu, t;
+
+  for_each_possible_cpu(cpu) {
+    struct sswap_rdma_pcpu_stats *s = per_cpu_ptr(&sswap_rdma_stats, cpu);
+
+    for (t = 0; t < NR_QP_TYPES; t++) {
+      sum.posts[t] += s->posts[t];
+      sum.cqes[t] += s->cqes[t];
+      sum.errors[t] += s->errors[t];
+      sum.backpressure[t] += s->backpressure[t];
+      sum.doorbells[t] += s->doorbells[t];
+      sum.poll_sleeps[t] += s->poll_sleeps[t];
+      sum.poll_irq_waits[t] += s->poll_irq_waits[t];
+      sum.replays[t] += s->replays[t];
+      sum.rebuilds[t] += s->rebuilds[t];
+      sum.deferrals[t] += s->deferrals[t];
+      sum.failovers[t] += s->failovers[t];
+    }
+  }
+
+  for (t = 0; t < NR_QP_TYPES; t++)
+    seq_printf(m, "%s posts=%llu doorbells=%llu cqes=%llu errors=%llu "
+               "backpressure=%llu poll_sleeps=%llu poll_irq_waits=%llu "
+               "replays=%llu rebuilds=%llu deferrals=%llu failovers=%llu\n",
+               qp_type_names[t], sum.posts[t], sum.doorbells[t], sum.cqes[t],
+               sum.errors[t], sum.backpressure[t], sum.poll_sleeps[t],
+               sum.poll_irq_waits[t], sum.replays[t], sum.rebuilds[t],
+               sum.deferrals[t], sum.failovers[t]);
+
+  return 0;
+}
+
+static int sswap_rdma_latency_show(struct seq_file *m, void *v)
+{
+  struct sswap_hist sum;
+  int cpu, t;
+
+  for (t = 0; t < NR_QP_TYPES; t++) {
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu)
+      sswap_hist_add(&sum, &per_cpu_ptr(&sswap_rdma_stats, cpu)->lat[t]);
+    sswap_hist_show(m, qp_type_names[t], &sum);
+  }
+
+  return 0;
+}
+
+static int sswap_rdma_queues_show(struct seq_file *m, void *v)
+{
+  struct rdma_queue *q;
+  int i, s, cpu;
+
+  mutex_lock(&qset_lock);
+  for (s = 0; s < nservers; s++) {
+    for (i = 0; i < numqueues; i++) {
+      if (!test_bit(i % max_qsets, live_qsets))
+        continue;
+
+      q = ctrls[s]->queues[i];
+      seq_printf(m, "%d server=%d cpu=%d node=%d type=%s comp_vector=%d "
+                 "pending=%d inflight=%d lat_ewma=%llu\n", i, s, q->cpu,
+                 cpu_to_node(q->cpu), qp_type_names[q->qp_type],
+                 q->comp_vector, atomic_read(&q->pending),
+                 atomic_read(&q->inflight), READ_ONCE(q->lat_ewma));
+    }
+  }
+
+  for_each_online_cpu(cpu) {
+    i = qmap[cpu];
+    if (i >= 0 && sswap_rdma_qset_cpu(i) != cpu)
+      seq_printf(m, "cpu %d -> set %d\n", cpu, i);
+  }
+  mutex_unlock(&qset_lock);
+
+  return 0;
+}
+
+static int sswap_rdma_space_show(struct seq_file *m, void *v)
+{
+  int s;
+
+  for (s = 0; s < nservers; s++)
+    seq_printf(m, "server=%d ip=%s live_bytes=%ld highwater=%lld\n", s,
+               serverips[s], atomic_long_read(&ctrls[s]->live_bytes),
+               atomic64_read(&ctrls[s]->highwater));
+
+  return 0;
+}
+
+static int sswap_rdma_space_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_rdma_space_show, NULL);
+}
+
+static int sswap_rdma_queues_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_rdma_queues_show, NULL);
+}
+
+static int sswap_rdma_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_rdma_stats_show, NULL);
+}
+
+static int sswap_rdma_latency_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, sswap_rdma_latency_show, NULL);
+}
+
+static ssize_t sswap_rdma_reset_write(struct file *file,
+    const char __user *buf, size_t count, loff_t *ppos)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(&sswap_rdma_stats, cpu), 0,
+           sizeof(struct sswap_rdma_pcpu_stats));
+
+  return count;
+}
+
+static const struct file_operations sswap_rdma_stats_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_rdma_stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_rdma_latency_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_rdma_latency_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_rdma_space_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_rdma_space_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_rdma_queues_fops = {
+  .owner = THIS_MODULE,
+  .open = sswap_rdma_queues_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations sswap_rdma_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = sswap_rdma_reset_write,
+  .llseek = noop_llseek,
+};
+
+static void sswap_rdma_init_debugfs(void)
+{
+  debugfs_root = debugfs_create_dir("fastswap_rdma", NULL);
+  if (IS_ERR_OR_NULL(debugfs_root)) {
+    pr_err("could not create debugfs dir\n");
+    return;
+  }
+
+  debugfs_create_file("stats", S_IRUGO, debugfs_root, NULL,
+                      &sswap_rdma_stats_fops);
+  debugfs_create_file("latency", S_IRUGO, debugfs_root, NULL,
+                      &sswap_rdma_latency_fops);
+  debugfs_create_file("queues", S_IRUGO, debugfs_root, NULL,
+                      &sswap_rdma_queues_fops);
+  debugfs_create_file("space", S_IRUGO, debugfs_root, NULL,
+                      &sswap_rdma_space_fops);
+  debugfs_create_file("reset", S_IWUSR, debugfs_root, NULL,
+                      &sswap_rdma_reset_fops);
+}
+
+static void sswap_rdma_destroy_pools(void)
+{
+  if (repl_pool)
+    mempool_destroy(repl_pool);
+  if (ecread_pool)
+    mempool_destroy(ecread_pool);
+  if (parity_pool)
+    mempool_destroy(parity_pool);
+}
+
+static void __exit sswap_rdma_cleanup_module(void)
+{
+  int i;
+
+  sswap_unregister_backend(&sswap_rdma_backend);
+  debugfs_remove_recursive(debugfs_root);
+  sswap_rdma_stopandfree_queues();
+  for (i = 0; i < nservers; i++)
+    cancel_work_sync(&ctrls[i]->recovery_work);
+  destroy_workqueue(recovery_wq);
+  sswap_rdma_destroy_pools();
+  ib_unregister_client(&sswap_rdma_ib_client);
+  for (i = 0; i < nservers; i++) {
+    kfree(ctrls[i]->queues);
+    kfree(ctrls[i]);
+    ctrls[i] = NULL;
+  }
+  kfree(qmap);
+  kfree(live_qsets);
+}
+
+/* claims the slot at the ring head, lockless against other posters.
+ * returns NULL when every slot is in flight */
+static struct rdma_req *sswap_rdma_alloc_req(struct rdma_queue *q)
+{
+  struct rdma_req *req;
+  unsigned long head;
+
+  do {
+    head = READ_ONCE(q->req_head);
+    if (head - READ_ONCE(q->req_tail) >= q->nreqs)
+      return NULL;
+  } while (cmpxchg(&q->req_head, head, head + 1) != head);
+
+  req = &q->reqs[head & (q->nreqs - 1)];
+  req->freed = false;
+  return req;
+}
+
+/* slots can complete out of order (posters race, chains), the tail only
+ * moves over a contiguous run of freed slots */
+static void sswap_rdma_free_req(struct rdma_queue *q, struct rdma_req *req)
+{
+  struct rdma_req *tail;
+  unsigned long flags;
+
+  spin_lock_irqsave(&q->ring_lock, flags);
+  req->freed = true;
+  while (q->req_tail != READ_ONCE(q->req_head)) {
+    tail = &q->reqs[q->req_tail & (q->nreqs - 1)];
+    if (!tail->freed)
+      break;
+    tail->freed = false;
+    smp_store_release(&q->req_tail, q->req_tail + 1);
+  }
+  spin_unlock_irqrestore(&q->ring_lock, flags);
+}
+
+/* weight 1/8, updated from the queue's completion context only */
+static inline void sswap_rdma_update_ewma(struct rdma_queue *q, u64 lat)
+{
+  u64 ewma = READ_ONCE(q->lat_ewma);
+
+  WRITE_ONCE(q->lat_ewma, ewma ? ewma - (ewma >> 3) + (lat >> 3) : lat);
+}
+
+static inline struct rdma_req *next_in_batch(struct rdma_req *req)
+{
+  return container_of(req->wr.wr.next, struct rdma_req, wr.wr);
+}
+
+/* wrs complete in order on a queue, so once the cqe for req shows up,
+ * every unsignaled wr chained in front of it completed successfully.
+ * Only the last wr of a chain is signaled, but when a wr fails every wr
+ * after it is flushed with its own cqe, so walk from where the last cqe
+ * of this chain left off. */
+static void sswap_rdma_complete_batch(struct ib_cq *cq, struct ib_wc *wc,
+                                      struct rdma_req *req)
+{
+  struct rdma_req *leader = req->leader;
+  struct rdma_req *r = leader->batch;
+  struct rdma_req *next;
+  struct ib_wc mwc = *wc;
+
+  mwc.status = IB_WC_SUCCESS;
+  while (r != req) {
+    next = next_in_batch(r);
+    mwc.wr_cqe = &r->cqe;
+    r->cqe.done(cq, &mwc);
+    r = next;
+  }
+
+  if (req != leader)
+    leader->batch = next_in_batch(req);
+}
+
+static inline bool sswap_rdma_link_error(enum ib_wc_status status)
+{
+  return status == IB_WC_WR_FLUSH_ERR || status == IB_WC_RETRY_EXC_ERR ||
+    status == IB_WC_RNR_RETRY_EXC_ERR;
+}
+
+/* a wr lost with the link keeps its slot, page and dma mapping and is
+ * posted again once the queue reconnected */
+static bool sswap_rdma_park_failed(struct rdma_queue *q, struct rdma_req *req,
+                                   enum ib_wc_status status)
+{
+  if (!sswap_rdma_link_error(status) || q->ctrl->state == CTRL_NEW)
+    return false;
+
+  llist_add(&req->lnode, &q->failed);
+  sswap_rdma_start_recovery(q->ctrl);
+  return true;
+}
+
+/* like a swap write with an io error: the page stays dirty and is
+ * written again rather than reclaimed without a remote copy */
+static void sswap_rdma_write_failed(struct page *page)
+{
+  SetPageError(page);
+  set_page_dirty(page);
+  ClearPageReclaim(page);
+  end_page_writeback(page);
+}
+
+static unsigned long sswap_rdma_slot_state(unsigned long slot)
+{
+  void *entry;
+
+  rcu_read_lock();
+  entry = radix_tree_lookup(&repl_slots, slot);
+  rcu_read_unlock();
+  return entry ? (unsigned long)entry >> RADIX_TREE_EXCEPTIONAL_SHIFT : 0;
+}
+
+/* caller holds repl_lock. only a preloaded caller may add an entry */
+static void sswap_rdma_slot_set(unsigned long slot, unsigned long state)
+{
+  void *entry = (void *)((state << RADIX_TREE_EXCEPTIONAL_SHIFT) |
+                         RADIX_TREE_EXCEPTIONAL_ENTRY);
+  void **p = radix_tree_lookup_slot(&repl_slots, slot);
+
+  if (!state)
+    radix_tree_delete(&repl_slots, slot);
+  else if (p)
+    radix_tree_replace_slot(&repl_slots, p, entry);
+  else if (radix_tree_insert(&repl_slots, slot, entry))
+    pr_err_ratelimited("no memory to track slot %lu\n", slot);
+}
+
+/* ctrl ids the page at roffset must not be read from */
+static inline unsigned long sswap_rdma_stale(u64 roffset)
+{
+  if (replicas < 2)
+    return 0;
+  return sswap_rdma_slot_state(roffset >> PAGE_SHIFT) >> SLOT_STALE_SHIFT;
+}
+
+/* the write of a replica of the slot was lost */
+static void sswap_rdma_slot_stale(unsigned long slot, int id)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&repl_lock, flags);
+  sswap_rdma_slot_set(slot, sswap_rdma_slot_state(slot) |
+                      BIT(id) << SLOT_STALE_SHIFT);
+  spin_unlock_irqrestore(&repl_lock, flags);
+}
+
+static void sswap_rdma_slot_release(unsigned long slot)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&repl_lock, flags);
+  sswap_rdma_slot_set(slot, sswap_rdma_slot_state(slot) & ~SLOT_BUSY);
+  spin_unlock_irqrestore(&repl_lock, flags);
+  wake_up_all(&repl_wait);
+}
+
+/* writeback ends once quorum writes have the page. with a smaller quorum
+ * than writes the store holds a page reference so the stragglers can
+ * still read it. The slot stays busy until every write is done, so that
+ * no store reuses it under them. A store that misses the quorum fails */
+static void sswap_rdma_repl_done(struct sswap_rdma_repl *repl, bool ok)
+{
+  if (ok && atomic_inc_return(&repl->acked) == repl->quorum)
+    end_page_writeback(repl->page);
+
+  if (!atomic_dec_and_test(&repl->remaining))
+    return;
+
+  if (atomic_read(&repl->acked) < repl->quorum) {
+    pr_err_ratelimited("store reached %d of %d servers\n",
+                       atomic_read(&repl->acked), repl->quorum);
+    sswap_rdma_write_failed(repl->page);
+  }
+  if (repl->pinned)
+    put_page(repl->page);
+  if (repl->tracked)
+    sswap_rdma_slot_release(repl->slot);
+  if (repl->parity)
+    mempool_free(repl->parity, parity_pool);
+  mempool_free(repl, repl_pool);
+}
+
+/* rebuilds the lost data fragments in place from the parity read */
+static void sswap_rdma_ec_decode(struct sswap_rdma_ecread *rd)
+{
+  void *ptrs[EC_MAX_K + 2], *srcs[MAX_XOR_BLOCKS];
+  u8 *data = kmap_atomic(rd->page);
+  u8 *parity = kmap_atomic(rd->parity);
+  int j, n = 0, fa = rd->lost[0], fb = rd->lost[1];
+
+  for (j = 0; j < ec_k; j++)
+    ptrs[j] = data + j * ec_frag;
+  ptrs[ec_k] = parity;
+  ptrs[ec_k + 1] = parity + ec_frag;
+
+  if (fb >= 0) {
+    raid6_2data_recov(ec_k + 2, ec_frag, fa, fb, ptrs);
+  } else if (!(rd->pq & 1)) {
+    /* p is scratch, the data comes from q */
+    raid6_datap_recov(ec_k + 2, ec_frag, fa, ptrs);
+  } else {
+    memcpy(ptrs[fa], ptrs[ec_k], ec_frag);
+    for (j = 0; j < ec_k; j++) {
+      if (j == fa)
+        continue;
+      srcs[n++] = ptrs[j];
+      if (n == MAX_XOR_BLOCKS) {
+        xor_blocks(n, ec_frag, ptrs[fa], srcs);
+        n = 0;
+      }
+    }
+    if (n)
+      xor_blocks(n, ec_frag, ptrs[fa], srcs);
+  }
+
+  kunmap_atomic(parity);
+  kunmap_atomic(data);
+}
+
+/* the page is up to date once all its fragments are in, and only if every
+ * one of them was read */
+static void sswap_rdma_ecread_done(struct rdma_queue *q,
+                                   struct sswap_rdma_ecread *rd, bool ok)
+{
+  if (!ok)
+    rd->failed = true;
+  if (!atomic_dec_and_test(&rd->remaining))
+    return;
+
+  if (rd->lost[0] >= 0) {
+    if (!rd->failed) {
+      sswap_rdma_ec_decode(rd);
+      this_cpu_inc(sswap_rdma_stats.rebuilds[q->qp_type]);
+    }
+    mempool_free(rd->parity, parity_pool);
+  }
+  if (!rd->failed)
+    SetPageUptodate(rd->page);
+  unlock_page(rd->page);
+  mempool_free(rd, ecread_pool);
+}
+
+static void sswap_rdma_write_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+  struct rdma_req *req =
+    container_of(wc->wr_cqe, struct rdma_req, cqe);
+  struct rdma_queue *q = cq->cq_context;
+  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  u64 lat;
+
+  sswap_rdma_complete_batch(cq, wc, req);
+  atomic_dec(&q->inflight);
+  lat = ktime_get_ns() - req->ts;
+  trace_sswap_rdma_cqe(q, req, wc, lat);
+  if (unlikely(wc->status != IB_WC_SUCCESS)) {
+    pr_err_ratelimited("sswap_rdma_write_done status is not success, it is=%d\n",
+                       wc->status);
+    trace_sswap_rdma_error(q, req, wc->status);
+    this_cpu_inc(sswap_rdma_stats.errors[q->qp_type]);
+    /* a lost replica is not waited for, it is stale until the next store
+     * and the store fails if that costs it its quorum */
+    if (req->repl && req->repl->tracked) {
+      sswap_rdma_slot_stale(req->repl->slot, q->ctrl->id);
+      if (sswap_rdma_link_error(wc->status))
+        sswap_rdma_start_recovery(q->ctrl);
+    } else if (sswap_rdma_park_failed(q, req, wc->status)) {
+      return;
+    }
+    //q->write_error = wc->status;
+  }
+  this_cpu_inc(sswap_rdma_stats.cqes[q->qp_type]);
+  sswap_hist_record(sswap_rdma_stats.lat[q->qp_type], lat);
+  sswap_rdma_update_ewma(q, lat);
+  ib_dma_unmap_page(ibdev, req->dma, req->len, DMA_TO_DEVICE);
+
+  /* the page is now remote, let reclaim have it */
+  if (req->repl)
+    sswap_rdma_repl_done(req->repl, wc->status == IB_WC_SUCCESS);
+  else if (unlikely(wc->status != IB_WC_SUCCESS))
+    sswap_rdma_write_failed(req->page);
+  else
+    end_page_writeback(req->page);
+  atomic_dec(&q->pending);
+  sswap_rdma_free_req(q, req);
+}
+
+static bool sswap_rdma_failover(struct rdma_queue *q, struct rdma_req *req);
+
+static void sswap_rdma_read_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+  struct rdma_req *req =
+    container_of(wc->wr_cqe, struct rdma_req, cqe);
+  struct rdma_queue *q = cq->cq_context;
+  struct ib_device *ibdev = q->ctrl->rdev->dev;
+  bool failover = false;
+  u64 lat;
+
+  sswap_rdma_complete_batch(cq, wc, req);
+  atomic_dec(&q->inflight);
+  lat = ktime_get_ns() - req->ts;
+  trace_sswap_rdma_cqe(q, req, wc, lat);
+  if (unlikely(wc->status != IB_WC_SUCCESS)) {
+    pr_err_ratelimited("sswap_rdma_read_done status is not success, it is=%d\n",
+                       wc->status);
+    trace_sswap_rdma_error(q, req, wc->status);
+    this_cpu_inc(sswap_rdma_stats.errors[q->qp_type]);
+    /* another replica has the page, the read is done here either way */
+    failover = sswap_rdma_failover(q, req);
+    if (failover && sswap_rdma_link_error(wc->status))
+      sswap_rdma_start_recovery(q->ctrl);
+    if (!failover && sswap_rdma_park_failed(q, req, wc->status))
+      return;
+  }
+  if (q->qp_type == QP_READ_SYNC)
+    atomic_dec(&q->ctrl->demand);
+  this_cpu_inc(sswap_rdma_stats.cqes[q->qp_type]);
+  sswap_hist_record(sswap_rdma_stats.lat[q->qp_type], lat);
+  sswap_rdma_update_ewma(q, lat);
+
+  ib_dma_unmap_page(ibdev, req->dma, req->len, DMA_FROM_DEVICE);
+
+  /* a page that could not be read is unlocked not up to date, the fault
+   * fails on it */
+  if (req->ecread) {
+    sswap_rdma_ecread_done(q, req->ecread, wc->status == IB_WC_SUCCESS);
+  } else if (!failover) {
+    if (likely(wc->status == IB_WC_SUCCESS))
+      SetPageUptodate(req->page);
+    unlock_page(req->page);
+  }
+  atomic_dec(&q->pending);
+  sswap_rdma_free_req(q, req);
+  /* a held back prefetch takes the slot this one had on the wire */
+  if (atomic_read(&q->deferred))
+    sswap_rdma_flush_batch(q);
+}
+
+static inline bool sswap_rdma_batching(struct rdma_queue *q)
+{
+  if (wr_batch <= 1)
+    return false;
+
+  /* demand reads and writes somebody waits on go out right away */
+  return q->qp_type == QP_READ_ASYNC ||
+    (q->qp_type == QP_WRITE_SYNC && async_writes);
+}
+
+/* wrs that could not be posted never get a cqe, complete them here */
+static void sswap_rdma_post_failed(struct rdma_queue *q,
+                                   struct ib_send_wr *bad_wr, int ret)
+{
+  struct ib_wc wc = {};
+  struct rdma_req *req;
+
+  pr_err_ratelimited("ib_post_send failed: %d\n", ret);
+  /* not a link error, the queue is fine and stays up */
+  wc.status = IB_WC_GENERAL_ERR;
+  while (bad_wr) {
+    req = container_of(bad_wr, struct rdma_req, wr.wr);
+    bad_wr = bad_wr->next;
+
+    trace_sswap_rdma_error(q, req, ret);
+    req->leader = req;
+    req->batch = req;
+    wc.wr_cqe = &req->cqe;
+    req->cqe.done(q->cq, &wc);
+  }
+}
+
+static void sswap_rdma_fence_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+  struct rdma_req *fence = container_of(wc->wr_cqe, struct rdma_req, cqe);
+  struct rdma_queue *q = cq->cq_context;
+
+  sswap_rdma_complete_batch(cq, wc, fence);
+  sswap_rdma_free_req(q, fence);
+}
+
+/* the wrs in front of bad_wr were posted unsignaled, and the leader of
+ * their chain was not. Fails the rest, then ends the posted ones with a
+ * signaled zero length write whose cqe completes them. If even that can't
+ * be posted the qp is in trouble: move it to error, where wrs still get
+ * their (flush) cqes, and let the recovery replay whatever was flushed */
+static void sswap_rdma_fence(struct rdma_queue *q, struct rdma_req *first,
+                             struct ib_send_wr *bad_wr, int err)
+{
+  struct sswap_rdma_memregion *mr = &q->ctrl->servermr;
+  struct ib_qp_attr attr = { .qp_state = IB_QPS_ERR };
+  struct rdma_req *req, *last, *fence;
+  struct ib_send_wr *fbad_wr;
+  int ret;
+
+  /* the posted wrs become a chain of their own before their leader goes */
+  for (last = first; last->wr.wr.next != bad_wr; last = next_in_batch(last))
+    ;
+  last->wr.wr.next = NULL;
+  last->batch = first;
+  for (req = first; req != last; req = next_in_batch(req))
+    req->leader = last;
+  last->leader = last;
+  sswap_rdma_post_failed(q, bad_wr, err);
+
+  fence = sswap_rdma_alloc_req(q);
+  if (unlikely(!fence)) {
+    pr_err_ratelimited("no slot to fence a failed post\n");
+    ib_modify_qp(q->qp, &attr, IB_QP_STATE);
+    sswap_rdma_start_recovery(q->ctrl);
+    return;
+  }
+
+  memset(&fence->wr, 0, sizeof(fence->wr));
+  fence->cqe.done = sswap_rdma_fence_done;
+  fence->wr.wr.wr_cqe = &fence->cqe;
+  fence->wr.wr.opcode = IB_WR_RDMA_WRITE;
+  fence->wr.wr.send_flags = IB_SEND_SIGNALED;
+  fence->wr.remote_addr = mr->baseaddr;
+  fence->wr.rkey = mr->key;
+  fence->ts = ktime_get_ns();
+  fence->leader = fence;
+  fence->batch = first;
+  last->wr.wr.next = &fence->wr.wr;
+  for (req = first; req != fence; req = next_in_batch(req))
+    req->leader = fence;
+
+  ret = ib_post_send(q->qp, &fence->wr.wr, &fbad_wr);
+  if (likely(!ret))
+    return;
+
+  pr_err_ratelimited("failed to post fence: %d\n", ret);
+  ib_modify_qp(q->qp, &attr, IB_QP_STATE);
+  sswap_rdma_start_recovery(q->ctrl);
+  ret = ib_post_send(q->qp, &fence->wr.wr, &fbad_wr);
+  if (ret)
+    pr_err("failed to post fence on the errored qp: %d\n", ret);
+}
+
+/* how many of the queued wrs may be posted. prefetches share the nic and
+ * the server's responder with demand reads, so while a demand read to the
+ * server is in flight a cpu keeps at most prefetch_depth of them posted.
+ * wrs are only held back behind posted ones, whose completions post them */
+static int sswap_rdma_budget(struct rdma_queue *q)
+{
+  int depth = READ_ONCE(prefetch_depth);
+
+  if (q->qp_type != QP_READ_ASYNC || depth <= 0 ||
+      !atomic_read(&q->ctrl->demand))
+    return INT_MAX;
+
+  return max(depth - atomic_read(&q->inflight), 0);
+}
+
+/* puts the wrs from node (oldest first) back on the batch. they keep
+ * their order among themselves, but wrs queued since the batch was taken
+ * are posted before them. Only prefetches are held back, which may go out
+ * in any order */
+static void sswap_rdma_defer(struct rdma_queue *q, struct llist_node *node)
+{
+  struct llist_node *last = node;
+  struct rdma_req *req;
+  int n = 0;
+
+  node = llist_reverse_order(node);
+  llist_for_each_entry(req, node, lnode)
+    n++;
+  llist_add_batch(node, last, &q->batch);
+  atomic_set(&q->deferred, 1);
+  this_cpu_add(sswap_rdma_stats.deferrals[q->qp_type], n);
+}
+
+/* posts the queued wrs the budget allows as a single chain: one doorbell,
+ * and only the last wr is signaled */
+static void sswap_rdma_flush_batch(struct rdma_queue *q)
+{
+  struct sswap_rdma_memregion *mr = &q->ctrl->servermr;
+  struct llist_node *nodes;
+  struct rdma_req *req, *first = NULL, *last = NULL;
+  struct ib_send_wr *bad_wr;
+  int ret, budget, n = 0;
+
+  /* while the link is down wrs stay queued, the recovery posts them on
+   * the new qp. The rcu read side lets it wait out posts on the old one */
+  rcu_read_lock();
+  if (unlikely(READ_ONCE(q->state) != QUEUE_LIVE))
+    goto out;
+
+  /* whoever takes the batch next posts or holds back what was deferred */
+  atomic_xchg(&q->deferred, 0);
+  nodes = llist_del_all(&q->batch);
+  if (!nodes)
+    goto out;
+
+  nodes = llist_reverse_order(nodes);
+  budget = sswap_rdma_budget(q);
+  while (nodes && n < budget) {
+    req = llist_entry(nodes, struct rdma_req, lnode);
+    nodes = nodes->next;
+    if (last)
+      last->wr.wr.next = &req->wr.wr;
+    else
+      first = req;
+    req->wr.wr.send_flags = 0;
+    req->wr.remote_addr = mr->baseaddr + req->roffset;
+    req->wr.rkey = mr->key;
+    last = req;
+    n++;
+  }
+  if (nodes)
+    sswap_rdma_defer(q, nodes);
+  if (!n)
+    goto out;
+
+  last->wr.wr.next = NULL;
+  last->wr.wr.send_flags = IB_SEND_SIGNALED;
+  last->batch = first;
+  for (req = first; req != last; req = next_in_batch(req))
+    req->leader = last;
+  last->leader = last;
+
+  atomic_sub(n, &q->nbatch);
+  atomic_add(n, &q->inflight);
+  this_cpu_inc(sswap_rdma_stats.doorbells[q->qp_type]);
+  ret = ib_post_send(q->qp, &first->wr.wr, &bad_wr);
+  if (unlikely(ret)) {
+    this_cpu_inc(sswap_rdma_stats.errors[q->qp_type]);
+    if (bad_wr != &first->wr.wr)
+      sswap_rdma_fence(q, first, bad_wr, ret);
+    else
+      sswap_rdma_post_failed(q, bad_wr, ret);
+  }
+out:
+  rcu_read_unlock();
+}
+
+static void sswap_rdma_unplug(struct blk_plug_cb *cb, bool from_schedule)
+{
+  int idx = srcu_read_lock(&qset_srcu);
+
+  sswap_rdma_flush_batch(cb->data);
+  srcu_read_unlock(&qset_srcu, idx);
+  kfree(cb);
+}
+
+/* queues the wr for qe. While the caller holds a block plug wrs are
+ * batched per queue and posted when the plug is flushed (or the batch is
+ * full), otherwise they are posted right away. Post errors are reported
+ * through the completion handler. */
+inline static int sswap_rdma_post_rdma(struct rdma_queue *q, struct rdma_req *qe,
+  u64 roffset, enum ib_wr_opcode op)
+{
+  BUG_ON(qe->dma == 0);
+
+  qe->sge.addr = qe->dma;
+  qe->sge.length = qe->len;
+  qe->sge.lkey = q->ctrl->rdev->pd->local_dma_lkey;
+
+  qe->wr.wr.next    = NULL;
+  qe->wr.wr.wr_cqe  = &qe->cqe;
+  qe->wr.wr.sg_list = &qe->sge;
+  qe->wr.wr.num_sge = 1;
+  qe->wr.wr.opcode  = op;
+  /* remote address and key are filled in when the wr is posted */
+  qe->roffset = roffset;
+
+  atomic_inc(&q->pending);
+  if (q->qp_type == QP_READ_SYNC)
+    atomic_inc(&q->ctrl->demand);
+  this_cpu_inc(sswap_rdma_stats.posts[q->qp_type]);
+  qe->ts = ktime_get_ns();
+  trace_sswap_rdma_post(q, qe, roffset, op);
+
+  llist_add(&qe->lnode, &q->batch);
+  if (atomic_inc_return(&q->nbatch) < wr_batch && sswap_rdma_batching(q) &&
+      blk_check_plugged(sswap_rdma_unplug, q, sizeof(struct blk_plug_cb)))
+    return 0;
+
+  sswap_rdma_flush_batch(q);
+  return 0;
+}
+
+/* polls up to budget wcs from a direct cq and runs their handlers.
+ * caller holds q->cq_lock */
+static int sswap_rdma_process_cq(struct rdma_queue *q, int budget)
+{
+  struct ib_wc wcs[POLL_BATCH];
+  int i, n, completed = 0;
+
+  while (completed < budget) {
+    n = ib_poll_cq(q->cq, min(budget - completed, POLL_BATCH), wcs);
+    if (n <= 0)
+      break;
+
+    for (i = 0; i < n; i++)
+      if (wcs[i].wr_cqe)
+        wcs[i].wr_cqe->done(q->cq, &wcs[i]);
+
+    completed += n;
+    if (n < POLL_BATCH)
+      break;
+  }
+
+  return completed;
+}
+
+static void sswap_rdma_wait_completion(struct rdma_queue *q,
+                                       struct rdma_req *qe)
+{
+  while (!completion_done(&qe->done)) {
+    spin_lock(&q->cq_lock);
+    sswap_rdma_process_cq(q, 1);
+    spin_unlock(&q->cq_lock);
+    cpu_relax();
+  }
+}
+
+/* sleeps until the cq raises a completion interrupt, or a jiffy passed in
+ * case we lost the race with the last completion */
+static void sswap_rdma_wait_irq(struct rdma_queue *q)
+{
+  int events = atomic_read(&q->cq_events);
+
+  this_cpu_inc(sswap_rdma_stats.poll_irq_waits[q->qp_type]);
+  if (ib_req_notify_cq(q->cq, IB_CQ_NEXT_COMP |
+                       IB_CQ_REPORT_MISSED_EVENTS) > 0)
+    return;
+
+  wait_event_timeout(q->cq_wait, atomic_read(&q->cq_events) != events, 1);
+}
+
+/* adaptive polling: spends the part of the oldest in-flight wr's expected
+ * latency during which polling the cq would be in vain away from the cq,
+ * sleeping when it is long enough for an hrtimer and yielding otherwise.
+ * Returns once we are poll_window_ns from the expected completion. Waits
+ * that exceed irq_wait_ns fall back to the completion interrupt. */
+static void sswap_rdma_wait_adaptive(struct rdma_queue *q)
+{
+  u64 expected = READ_ONCE(q->lat_ewma);
+  u64 elapsed, remaining;
+  struct rdma_req *oldest;
+  ktime_t timeout;
+
+  /* no samples yet, just poll */
+  if (!expected)
+    return;
+
+  oldest = &q->reqs[READ_ONCE(q->req_tail) & (q->nreqs - 1)];
+  elapsed = ktime_get_ns() - READ_ONCE(oldest->ts);
+
+  if (elapsed >= expected) {
+    if (elapsed >= irq_wait_ns)
+      sswap_rdma_wait_irq(q);
+    return;
+  }
 
-  req->cqe.done = sswap_rdma_read_done;
-  ret = sswap_rdma_post_rdma(q, req, &sge, roffset, IB_WR_RDMA_READ);
-  return ret;
+  remaining = expected - elapsed;
+  if (remaining <= poll_window_ns)
+    return;
+  remaining -= poll_window_ns;
+
+  if (remaining >= sleep_min_ns) {
+    this_cpu_inc(sswap_rdma_stats.poll_sleeps[q->qp_type]);
+    timeout = ns_to_ktime(remaining);
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout_range(&timeout, poll_window_ns, HRTIMER_MODE_REL);
+  } else if (!cond_resched()) {
+    /* too short to give the cpu away, but stay off the cq */
+    ndelay(remaining);
+  }
 }
 
-int sswap_rdma_write(struct page *page, u64 roffset)
+/* wrs don't complete while the link is down, give the cpu to the
+ * recovery instead of polling. Bounded by the connection timeout */
+static inline void sswap_rdma_wait_live(struct rdma_queue *q)
 {
-  pr_info("start: %s\n", __FUNCTION__);
+  struct sswap_rdma_ctrl *ctrl = q->ctrl;
+
+  if (likely(READ_ONCE(ctrl->state) != CTRL_RECOVERING))
+    return;
+
+  wait_event_timeout(ctrl->live_wait,
+                     READ_ONCE(ctrl->state) != CTRL_RECOVERING, HZ);
+}
+
+/* waits until target wrs completed or qp is empty, for queues whose
+ * completions are reaped from softirq */
+static inline void wait_target_softirq(struct rdma_queue *q, int target)
+{
+  int start = atomic_read(&q->pending);
+
+  sswap_rdma_flush_batch(q);
+  while (atomic_read(&q->pending) > max(start - target, 0)) {
+    sswap_rdma_wait_live(q);
+    cpu_relax();
+  }
+}
+
+/* polls queue until we reach target completed wrs or qp is empty. direct
+ * cqs are only ever polled from process context, so cq_lock doesn't need
+ * to disable irqs */
+static inline int poll_target(struct rdma_queue *q, int target)
+{
+  int completed = 0;
+
+  sswap_rdma_flush_batch(q);
+  while (completed < target && atomic_read(&q->pending) > 0) {
+    sswap_rdma_wait_live(q);
+    spin_lock(&q->cq_lock);
+    completed += sswap_rdma_process_cq(q, target - completed);
+    spin_unlock(&q->cq_lock);
+    cpu_relax();
+  }
+
+  return completed;
+}
+
+/* waits for every in-flight wr of a direct queue. callers may sleep */
+static inline int drain_queue(struct rdma_queue *q)
+{
+  sswap_rdma_flush_batch(q);
+  while (atomic_read(&q->pending) > 0) {
+    sswap_rdma_wait_live(q);
+    if (poll_mode)
+      sswap_rdma_wait_adaptive(q);
+
+    spin_lock(&q->cq_lock);
+    sswap_rdma_process_cq(q, POLL_BATCH);
+    spin_unlock(&q->cq_lock);
+    cpu_relax();
+  }
+
+  return 1;
+}
+
+/* back pressure, waits for target wrs to complete */
+static inline void wait_target(struct rdma_queue *q, int target)
+{
+  if (q->poll_ctx == IB_POLL_DIRECT)
+    poll_target(q, target);
+  else
+    wait_target_softirq(q, target);
+}
+
+/* sets req, a slot of q's ring, up for len bytes of page from off. The
+ * slot is given back if the page can't be mapped */
+static int sswap_rdma_map_req(struct rdma_queue *q, struct rdma_req *req,
+                              struct page *page, u32 off, u32 len,
+                              enum dma_data_direction dir)
+{
+  struct ib_device *dev = q->ctrl->rdev->dev;
+
+  req->page = page;
+  req->len = len;
+  req->repl = NULL;
+  req->ecread = NULL;
+  req->dma = ib_dma_map_page(dev, page, off, len, dir);
+  if (unlikely(ib_dma_mapping_error(dev, req->dma))) {
+    pr_err_ratelimited("ib_dma_mapping_error\n");
+    sswap_rdma_free_req(q, req);
+    return -ENOMEM;
+  }
+
+  ib_dma_sync_single_for_device(dev, req->dma, len, dir);
+  return 0;
+}
+
+/* takes a request slot from q's ring, waiting for completions if the
+ * ring is full, creates a dma mapping for it in req->dma, and
+ * synchronizes the dma mapping in the direction of the dma map.
+ * Don't touch the page with cpu after creating the request for it! */
+/* maps len bytes of page from off, a fragment of it with erasure coding */
+static int get_req_for_frag(struct rdma_req **req, struct rdma_queue *q,
+                            struct page *page, u32 off, u32 len,
+                            enum dma_data_direction dir)
+{
+
+  /* back pressure in-flight wrs, can't have more than the send queue
+   * depth posted at a time */
+  while (unlikely(!(*req = sswap_rdma_alloc_req(q)))) {
+    trace_sswap_rdma_backpressure(q, atomic_read(&q->pending));
+    this_cpu_inc(sswap_rdma_stats.backpressure[q->qp_type]);
+    wait_target(q, q->qp_type == QP_WRITE_SYNC ? q->nreqs / 2 : 8);
+  }
+
+  return sswap_rdma_map_req(q, *req, page, off, len, dir);
+}
+
+static inline int get_req_for_page(struct rdma_req **req,
+                                   struct rdma_queue *q, struct page *page,
+                                   enum dma_data_direction dir)
+{
+  return get_req_for_frag(req, q, page, 0, PAGE_SIZE, dir);
+}
+
+static inline int write_queue_add(struct rdma_queue *q, struct page *page,
+				  u64 roffset, struct sswap_rdma_repl *repl)
+{
+  struct rdma_req *req;
   int ret;
-  struct rdma_queue *q;
 
-  VM_BUG_ON_PAGE(!PageSwapCache(page), page);
+  ret = get_req_for_page(&req, q, page, DMA_TO_DEVICE);
+  if (unlikely(ret))
+    return ret;
+
+  req->repl = repl;
+  req->cqe.done = sswap_rdma_write_done;
+  ret = sswap_rdma_post_rdma(q, req, roffset, IB_WR_RDMA_WRITE);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_WRITE_SYNC);
-  ret = write_queue_add(q, page, roffset);
-  BUG_ON(ret);
-  drain_queue(q);
   return ret;
 }
-EXPORT_SYMBOL(sswap_rdma_write);
 
-static int sswap_rdma_recv_remotemr(struct sswap_rdma_ctrl *ctrl)
+static inline int write_frag_add(struct rdma_queue *q, struct page *page,
+                                 u32 off, u64 roffset,
+                                 struct sswap_rdma_repl *repl)
 {
-  struct rdma_req *qe;
+  struct rdma_req *req;
   int ret;
-  struct ib_device *dev;
 
-  pr_info("start: %s\n", __FUNCTION__);
-  dev = ctrl->rdev->dev;
+  ret = get_req_for_frag(&req, q, page, off, ec_frag, DMA_TO_DEVICE);
+  if (unlikely(ret))
+    return ret;
+
+  req->repl = repl;
+  req->cqe.done = sswap_rdma_write_done;
+  return sswap_rdma_post_rdma(q, req, roffset, IB_WR_RDMA_WRITE);
+}
+
+static inline int begin_frag_read(struct rdma_queue *q, struct page *page,
+                                  u32 off, u64 roffset,
+                                  struct sswap_rdma_ecread *rd)
+{
+  struct rdma_req *req;
+  int ret;
 
-  ret = get_req_for_buf(&qe, dev, &(ctrl->servermr), sizeof(ctrl->servermr),
-			DMA_FROM_DEVICE);
+  ret = get_req_for_frag(&req, q, page, off, ec_frag, DMA_FROM_DEVICE);
   if (unlikely(ret))
-    goto out;
+    return ret;
 
-  qe->cqe.done = sswap_rdma_recv_remotemr_done;
+  req->ecread = rd;
+  req->cqe.done = sswap_rdma_read_done;
+  return sswap_rdma_post_rdma(q, req, roffset, IB_WR_RDMA_READ);
+}
 
-  ret = sswap_rdma_post_recv(&(ctrl->queues[0]), qe, sizeof(struct sswap_rdma_memregion));
+/* roffset is the offset on q's server, swapoff the page's in swap space.
+ * a failed read is not tried again on the servers in stale */
+static inline int begin_read(struct rdma_queue *q, struct page *page,
+			     u64 roffset, u64 swapoff, unsigned long stale)
+{
+  struct rdma_req *req;
+  int ret;
 
+  ret = get_req_for_page(&req, q, page, DMA_FROM_DEVICE);
   if (unlikely(ret))
-    goto out_free_qe;
+    return ret;
+
+  req->swapoff = swapoff;
+  req->tried = stale | BIT(q->ctrl->id);
+  req->cqe.done = sswap_rdma_read_done;
+  ret = sswap_rdma_post_rdma(q, req, roffset, IB_WR_RDMA_READ);
+  return ret;
+}
 
-  /* this delay doesn't really matter, only happens once */
-  sswap_rdma_wait_completion(ctrl->queues[0].cq, qe);
+/* maps an offset in swap space and a replica of it to the server holding
+ * it and the offset in that server's memory region */
+struct sswap_rdma_placement {
+  const char *name;
+  int (*map)(u64 roffset, int replica, u64 *soffset);
+};
 
-out_free_qe:
-  kmem_cache_free(req_cache, qe);
-out:
+/* round robin over the servers in units of stripe_pages, replica r of a
+ * stripe goes to the r-th server after the primary */
+static int sswap_rdma_map_stripe(u64 roffset, int replica, u64 *soffset)
+{
+  u64 unit = (u64)stripe_pages << PAGE_SHIFT;
+  u64 rem, stripe, row;
+  u32 server;
+
+  stripe = div64_u64_rem(roffset, unit, &rem);
+  row = div_u64_rem(stripe, nservers, &server);
+  *soffset = (row * replicas + replica) * unit + rem;
+  return (server + replica) % nservers;
+}
+
+static const struct sswap_rdma_placement sswap_rdma_placements[] = {
+  { "stripe", sswap_rdma_map_stripe },
+};
+
+static const struct sswap_rdma_placement *placement_ops;
+
+static inline struct sswap_rdma_ctrl *sswap_rdma_place(u64 roffset,
+                                                       int replica,
+                                                       u64 *soffset)
+{
+  return ctrls[placement_ops->map(roffset, replica, soffset)];
+}
+
+/* the replica queue of cpu's set expected to finish a read first, going by
+ * its recent latency and what is queued ahead. servers that are
+ * reconnecting are only picked when every replica is, servers in exclude
+ * (a mask of ctrl ids) never. NULL if every replica is excluded */
+static struct rdma_queue *sswap_rdma_read_queue(u64 roffset,
+                                                enum qp_type type, int cpu,
+                                                unsigned long exclude,
+                                                u64 *soffset)
+{
+  struct rdma_queue *q, *best = NULL;
+  struct sswap_rdma_ctrl *ctrl;
+  u64 cost, best_cost = U64_MAX, off;
+  bool best_live = false, live;
+  int r;
+
+  for (r = 0; r < replicas; r++) {
+    ctrl = sswap_rdma_place(roffset, r, &off);
+    if (exclude & BIT(ctrl->id))
+      continue;
+    q = sswap_rdma_get_queue(ctrl, cpu, type);
+    live = READ_ONCE(ctrl->state) != CTRL_RECOVERING;
+    cost = READ_ONCE(q->lat_ewma) * (atomic_read(&q->pending) + 1);
+    if (best && (best_live > live ||
+                 (best_live == live && best_cost <= cost)))
+      continue;
+
+    best = q;
+    best_cost = cost;
+    best_live = live;
+    *soffset = off;
+  }
+
+  return best;
+}
+
+/* the queue a read of the page at roffset goes to on this cpu, skipping
+ * stale replicas unless they are all there is */
+static struct rdma_queue *sswap_rdma_replica_queue(u64 roffset,
+                                                   enum qp_type type,
+                                                   u64 *soffset,
+                                                   unsigned long *stale)
+{
+  struct rdma_queue *q;
+
+  *stale = sswap_rdma_stale(roffset);
+  q = sswap_rdma_read_queue(roffset, type, smp_processor_id(), *stale,
+                            soffset);
+  if (q)
+    return q;
+
+  *stale = 0;
+  return sswap_rdma_read_queue(roffset, type, smp_processor_id(), 0,
+                               soffset);
+}
+
+/* re-issues a replicated read that failed on q to the best live replica
+ * it was not read from yet, rather than waiting for q's server to come
+ * back. Runs in completion context, so it doesn't wait for a request
+ * slot. returns false if the read has nowhere to go */
+static bool sswap_rdma_failover(struct rdma_queue *q, struct rdma_req *req)
+{
+  struct rdma_queue *nq;
+  struct rdma_req *nreq;
+  u64 soffset;
+
+  if (replicas < 2 || req->ecread)
+    return false;
+
+  nq = sswap_rdma_read_queue(req->swapoff, q->qp_type, q->cpu, req->tried,
+                             &soffset);
+  if (!nq || READ_ONCE(nq->ctrl->state) == CTRL_RECOVERING)
+    return false;
+
+  nreq = sswap_rdma_alloc_req(nq);
+  if (!nreq)
+    return false;
+  if (sswap_rdma_map_req(nq, nreq, req->page, 0, PAGE_SIZE,
+                         DMA_FROM_DEVICE))
+    return false;
+
+  nreq->swapoff = req->swapoff;
+  nreq->tried = req->tried | BIT(nq->ctrl->id);
+  nreq->cqe.done = sswap_rdma_read_done;
+  this_cpu_inc(sswap_rdma_stats.failovers[q->qp_type]);
+  sswap_rdma_post_rdma(nq, nreq, soffset, IB_WR_RDMA_READ);
+  return true;
+}
+
+static int sswap_rdma_parse_placement(void)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(sswap_rdma_placements); i++) {
+    if (!strcmp(placement, sswap_rdma_placements[i].name)) {
+      placement_ops = &sswap_rdma_placements[i];
+      return 0;
+    }
+  }
+
+  pr_err("unknown placement %s\n", placement);
+  return -EINVAL;
+}
+
+/* fragment j of a page is on the j-th server after the page's first, p
+ * and q are fragments ec_k and ec_k + 1. every server keeps one fragment
+ * per page, at the same offset */
+static inline struct sswap_rdma_ctrl *sswap_rdma_ec_place(u64 roffset, int j,
+                                                          u64 *soffset)
+{
+  u64 pgoff = roffset >> PAGE_SHIFT;
+  u32 first;
+
+  div_u64_rem(pgoff, nservers, &first);
+  *soffset = pgoff * ec_frag;
+  return ctrls[(first + j) % nservers];
+}
+
+static inline bool sswap_rdma_ec_live(u64 roffset, int j)
+{
+  u64 soffset;
+
+  return READ_ONCE(sswap_rdma_ec_place(roffset, j, &soffset)->state) !=
+    CTRL_RECOVERING;
+}
+
+/* keeps the servers' live bytes in step with stores (sign 1) and
+ * invalidates (sign -1) of the page at roffset */
+static void sswap_rdma_account(u64 roffset, long sign)
+{
+  int r, n = ec_k ? ec_k + ec_m : replicas;
+  long len = ec_k ? ec_frag : PAGE_SIZE;
+  struct sswap_rdma_ctrl *ctrl;
+  u64 soffset, end, hw, old;
+
+  for (r = 0; r < n; r++) {
+    if (ec_k)
+      ctrl = sswap_rdma_ec_place(roffset, r, &soffset);
+    else
+      ctrl = sswap_rdma_place(roffset, r, &soffset);
+    atomic_long_add(sign * len, &ctrl->live_bytes);
+
+    end = soffset + len;
+    hw = atomic64_read(&ctrl->highwater);
+    while (sign > 0 && end > hw) {
+      old = atomic64_cmpxchg(&ctrl->highwater, hw, end);
+      if (old == hw)
+        break;
+      hw = old;
+    }
+  }
+}
+
+/* the parity is computed with the raid6 library, which picks the fastest
+ * simd routines at boot and saves the fpu state around them */
+static int sswap_rdma_write_ec(struct page *page, u64 roffset)
+{
+  void *ptrs[EC_MAX_K + 2];
+  struct sswap_rdma_repl *repl;
+  struct sswap_rdma_ctrl *ctrl;
+  struct rdma_queue *q;
+  u8 *data, *parity;
+  u64 soffset;
+  int j, idx, ret = 0;
+
+  repl = mempool_alloc(repl_pool, GFP_NOIO);
+  repl->page = page;
+  repl->parity = mempool_alloc(parity_pool, GFP_NOIO);
+  atomic_set(&repl->remaining, ec_k + ec_m);
+  atomic_set(&repl->acked, 0);
+  repl->quorum = ec_k + ec_m;
+  repl->pinned = false;
+  repl->tracked = false;
+
+  data = kmap_atomic(page);
+  parity = kmap_atomic(repl->parity);
+  for (j = 0; j < ec_k; j++)
+    ptrs[j] = data + j * ec_frag;
+  /* q is computed but not sent with ec_m = 1 */
+  ptrs[ec_k] = parity;
+  ptrs[ec_k + 1] = parity + ec_frag;
+  raid6_call.gen_syndrome(ec_k + 2, ec_frag, ptrs);
+  kunmap_atomic(parity);
+  kunmap_atomic(data);
+
+  idx = srcu_read_lock(&qset_srcu);
+  for (j = 0; j < ec_k + ec_m; j++) {
+    ctrl = sswap_rdma_ec_place(roffset, j, &soffset);
+    q = sswap_rdma_get_queue(ctrl, smp_processor_id(), QP_WRITE_SYNC);
+    if (j < ec_k)
+      ret = write_frag_add(q, page, j * ec_frag, soffset, repl);
+    else
+      ret = write_frag_add(q, repl->parity, (j - ec_k) * ec_frag, soffset,
+                           repl);
+    BUG_ON(ret);
+  }
+  if (!async_writes)
+    for (j = 0; j < ec_k + ec_m; j++) {
+      ctrl = sswap_rdma_ec_place(roffset, j, &soffset);
+      drain_queue(sswap_rdma_get_queue(ctrl, smp_processor_id(),
+                                       QP_WRITE_SYNC));
+    }
+  srcu_read_unlock(&qset_srcu, idx);
+  return ret;
+}
+
+/* reads the data fragments straight into the page. data on servers that
+ * are reconnecting is rebuilt from parity when enough of it is reachable,
+ * otherwise the read waits for the reconnect like any other */
+static int sswap_rdma_read_ec(struct page *page, u64 roffset,
+                              enum qp_type type)
+{
+  struct sswap_rdma_ecread *rd;
+  struct sswap_rdma_ctrl *ctrl;
+  struct rdma_queue *q;
+  int j, nlost = 0, posted = 0, ret = 0;
+  /* demand reads run with preemption off, the fault falls back to an
+   * async read when the pools are empty */
+  gfp_t gfp = type == QP_READ_SYNC ? GFP_NOWAIT : GFP_NOIO;
+  u64 soffset;
+
+  rd = mempool_alloc(ecread_pool, gfp);
+  if (unlikely(!rd))
+    return -ENOMEM;
+  rd->page = page;
+  rd->parity = NULL;
+  rd->lost[0] = rd->lost[1] = -1;
+  rd->pq = 0;
+  rd->failed = false;
+
+  for (j = 0; j < ec_k && nlost < ec_m; j++)
+    if (!sswap_rdma_ec_live(roffset, j))
+      rd->lost[nlost++] = j;
+
+  if (nlost) {
+    if (sswap_rdma_ec_live(roffset, ec_k))
+      rd->pq |= 1;
+    if (ec_m > 1 && sswap_rdma_ec_live(roffset, ec_k + 1))
+      rd->pq |= 2;
+
+    if (nlost == 2 && rd->pq != 3) {
+      rd->lost[1] = -1;
+      nlost = 1;
+    }
+    if (nlost == 1 && rd->pq == 3)
+      rd->pq = 1;
+    if (!rd->pq) {
+      rd->lost[0] = -1;
+      nlost = 0;
+    }
+  }
+  if (nlost) {
+    rd->parity = mempool_alloc(parity_pool, gfp);
+    if (unlikely(!rd->parity)) {
+      mempool_free(rd, ecread_pool);
+      return -ENOMEM;
+    }
+  }
+  atomic_set(&rd->remaining, ec_k);
+
+  for (j = 0; j < ec_k + ec_m; j++) {
+    ctrl = sswap_rdma_ec_place(roffset, j, &soffset);
+    q = sswap_rdma_get_queue(ctrl, smp_processor_id(), type);
+    if (j < ec_k) {
+      if (j == rd->lost[0] || j == rd->lost[1])
+        continue;
+      ret = begin_frag_read(q, page, j * ec_frag, soffset, rd);
+    } else if (rd->pq & (1 << (j - ec_k))) {
+      ret = begin_frag_read(q, rd->parity, (j - ec_k) * ec_frag, soffset,
+                            rd);
+    } else {
+      continue;
+    }
+    if (unlikely(ret))
+      break;
+    posted++;
+  }
+  if (likely(!ret))
+    return 0;
+
+  /* the fragments in flight unlock the page, not up to date. If none is
+   * left the read failed as a whole and the caller keeps the page */
+  rd->failed = true;
+  if (!atomic_sub_and_test(ec_k - posted, &rd->remaining))
+    return 0;
+
+  if (rd->parity)
+    mempool_free(rd->parity, parity_pool);
+  mempool_free(rd, ecread_pool);
+  return ret;
+}
+
+/* waits until no writes of the slot's last store are in flight and makes
+ * the slot busy, with the replicas in stale skipped by this store. Those
+ * writes may sit in this cpu's plugged batches, so they go out first */
+static void sswap_rdma_slot_claim(unsigned long slot, unsigned long stale)
+{
+  unsigned long flags;
+  bool preloaded;
+  int i, idx;
+
+  if (sswap_rdma_slot_state(slot) & SLOT_BUSY) {
+    idx = srcu_read_lock(&qset_srcu);
+    for (i = 0; i < nservers; i++)
+      sswap_rdma_flush_batch(sswap_rdma_get_queue(ctrls[i],
+                                                  smp_processor_id(),
+                                                  QP_WRITE_SYNC));
+    srcu_read_unlock(&qset_srcu, idx);
+  }
+
+  for (;;) {
+    wait_event(repl_wait, !(sswap_rdma_slot_state(slot) & SLOT_BUSY));
+    /* without a preload the insert falls back to an atomic allocation */
+    preloaded = !radix_tree_preload(GFP_NOIO);
+    spin_lock_irqsave(&repl_lock, flags);
+    if (!(sswap_rdma_slot_state(slot) & SLOT_BUSY)) {
+      sswap_rdma_slot_set(slot, SLOT_BUSY | stale << SLOT_STALE_SHIFT);
+      spin_unlock_irqrestore(&repl_lock, flags);
+      if (preloaded)
+        radix_tree_preload_end();
+      return;
+    }
+    spin_unlock_irqrestore(&repl_lock, flags);
+    if (preloaded)
+      radix_tree_preload_end();
+  }
+}
+
+/* page is under writeback, writeback ends when the wr is done.
+ * with async_writes we return as soon as the wr is posted, otherwise
+ * we wait for it. Replicas on servers that are reconnecting are skipped
+ * and become stale, the store fails if that leaves less than a quorum */
+static int sswap_rdma_write(struct page *page, u64 roffset)
+{
+  int ret = 0, idx, r;
+  struct rdma_queue *q;
+  struct sswap_rdma_ctrl *ctrl;
+  struct sswap_rdma_repl *repl = NULL;
+  unsigned long stale = 0;
+  u64 soffset;
+
+  VM_BUG_ON_PAGE(!PageWriteback(page), page);
+
+  if (ec_k) {
+    sswap_rdma_account(roffset, 1);
+    return sswap_rdma_write_ec(page, roffset);
+  }
+
+  if (replicas > 1) {
+    for (r = 0; r < replicas; r++) {
+      ctrl = sswap_rdma_place(roffset, r, &soffset);
+      if (READ_ONCE(ctrl->state) == CTRL_RECOVERING)
+        stale |= BIT(ctrl->id);
+    }
+    if (replicas - hweight_long(stale) < write_quorum)
+      return -EAGAIN;
+
+    repl = mempool_alloc(repl_pool, GFP_NOIO);
+    repl->page = page;
+    repl->parity = NULL;
+    atomic_set(&repl->remaining, replicas - hweight_long(stale));
+    atomic_set(&repl->acked, 0);
+    repl->quorum = write_quorum;
+    repl->pinned = write_quorum < replicas;
+    if (repl->pinned)
+      get_page(page);
+    repl->tracked = true;
+    repl->slot = roffset >> PAGE_SHIFT;
+    sswap_rdma_slot_claim(repl->slot, stale);
+  }
+  sswap_rdma_account(roffset, 1);
+
+  /* replicas go out on this cpu's write queue of each server, so they
+   * are in flight at the same time */
+  idx = srcu_read_lock(&qset_srcu);
+  for (r = 0; r < replicas; r++) {
+    ctrl = sswap_rdma_place(roffset, r, &soffset);
+    if (stale & BIT(ctrl->id))
+      continue;
+    q = sswap_rdma_get_queue(ctrl, smp_processor_id(), QP_WRITE_SYNC);
+    ret = write_queue_add(q, page, soffset, repl);
+    BUG_ON(ret);
+  }
+  if (!async_writes)
+    for (r = 0; r < replicas; r++) {
+      ctrl = sswap_rdma_place(roffset, r, &soffset);
+      if (stale & BIT(ctrl->id))
+        continue;
+      drain_queue(sswap_rdma_get_queue(ctrl, smp_processor_id(),
+                                       QP_WRITE_SYNC));
+    }
+  srcu_read_unlock(&qset_srcu, idx);
   return ret;
 }
 
 /* page is unlocked when the wr is done.
  * posts an RDMA read on this cpu's qp */
-int sswap_rdma_read_async(struct page *page, u64 roffset)
+static int sswap_rdma_read_async(struct page *page, u64 roffset)
 {
-  pr_info("start: %s\n", __FUNCTION__);
   struct rdma_queue *q;
-  int ret;
+  unsigned long stale;
+  u64 soffset;
+  int ret, idx;
 
-  VM_BUG_ON_PAGE(!PageSwapCache(page), page);
   VM_BUG_ON_PAGE(!PageLocked(page), page);
   VM_BUG_ON_PAGE(PageUptodate(page), page);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_ASYNC);
-  ret = begin_read(q, page, roffset);
+  idx = srcu_read_lock(&qset_srcu);
+  if (ec_k) {
+    ret = sswap_rdma_read_ec(page, roffset, QP_READ_ASYNC);
+  } else {
+    q = sswap_rdma_replica_queue(roffset, QP_READ_ASYNC, &soffset, &stale);
+    ret = begin_read(q, page, soffset, roffset, stale);
+  }
+  srcu_read_unlock(&qset_srcu, idx);
   return ret;
 }
-EXPORT_SYMBOL(sswap_rdma_read_async);
 
-int sswap_rdma_read_sync(struct page *page, u64 roffset)
+static int sswap_rdma_read_sync(struct page *page, u64 roffset)
 {
-  pr_info("start: %s\n", __FUNCTION__);
   struct rdma_queue *q;
-  int ret;
+  unsigned long stale;
+  u64 soffset;
+  int ret, idx;
 
-  VM_BUG_ON_PAGE(!PageSwapCache(page), page);
   VM_BUG_ON_PAGE(!PageLocked(page), page);
   VM_BUG_ON_PAGE(PageUptodate(page), page);
 
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_SYNC);
-  ret = begin_read(q, page, roffset);
+  idx = srcu_read_lock(&qset_srcu);
+  if (ec_k) {
+    ret = sswap_rdma_read_ec(page, roffset, QP_READ_SYNC);
+  } else {
+    q = sswap_rdma_replica_queue(roffset, QP_READ_SYNC, &soffset, &stale);
+    ret = begin_read(q, page, soffset, roffset, stale);
+  }
+  srcu_read_unlock(&qset_srcu, idx);
   return ret;
 }
-EXPORT_SYMBOL(sswap_rdma_read_sync);
 
-int sswap_rdma_poll_load(int cpu)
+/* the demand read may be on any server, queues without reads in flight
+ * return right away. prefetches held back for it are posted after */
+static int sswap_rdma_poll_load(int cpu)
 {
-  pr_info("start: %s\n", __FUNCTION__);
-  struct rdma_queue *q = sswap_rdma_get_queue(cpu, QP_READ_SYNC);
-  return drain_queue(q);
+  int i, ret = 0, idx = srcu_read_lock(&qset_srcu);
+  struct rdma_queue *q;
+  bool again;
+
+  /* a failed replicated read moves on to another server's queue, maybe
+   * one drained already */
+  do {
+    again = false;
+    for (i = 0; i < nservers; i++)
+      ret = drain_queue(sswap_rdma_get_queue(ctrls[i], cpu, QP_READ_SYNC));
+    for (i = 0; i < nservers && replicas > 1; i++)
+      if (atomic_read(&sswap_rdma_get_queue(ctrls[i], cpu,
+                                            QP_READ_SYNC)->pending))
+        again = true;
+  } while (again);
+  for (i = 0; i < nservers; i++) {
+    q = sswap_rdma_get_queue(ctrls[i], cpu, QP_READ_ASYNC);
+    if (atomic_read(&q->deferred))
+      sswap_rdma_flush_batch(q);
+  }
+  srcu_read_unlock(&qset_srcu, idx);
+  return ret;
 }
-EXPORT_SYMBOL(sswap_rdma_poll_load);
 
-/* idx is absolute id (i.e. > than number of cpus) */
-inline enum qp_type get_queue_type(unsigned int idx)
+/* the slot's remote copies are dead. nothing goes over the wire, the
+ * servers' regions are preallocated and a later store simply overwrites
+ * them */
+static void sswap_rdma_invalidate(u64 roffset)
 {
-  // numcpus = 8
-  //idx = idx % numqueues;
-  if (idx < numcpus)
-    return QP_READ_SYNC;
-  else if (idx < numcpus * 2)
-    return QP_READ_ASYNC;
-  else if (idx < numcpus * 3)
-    return QP_WRITE_SYNC;
+  unsigned long slot = roffset >> PAGE_SHIFT, flags;
+
+  sswap_rdma_account(roffset, -1);
+  /* forget the stale replicas, a store still in flight keeps it busy */
+  if (replicas > 1 && sswap_rdma_slot_state(slot)) {
+    spin_lock_irqsave(&repl_lock, flags);
+    sswap_rdma_slot_set(slot, sswap_rdma_slot_state(slot) & SLOT_BUSY);
+    spin_unlock_irqrestore(&repl_lock, flags);
+  }
+}
 
-  BUG();
-  return QP_READ_SYNC;
+static struct sswap_backend_ops sswap_rdma_backend = {
+  .name = "rdma",
+  .owner = THIS_MODULE,
+  .caps = SSWAP_CAP_ASYNC_STORE | SSWAP_CAP_ASYNC_LOAD,
+  .store = sswap_rdma_write,
+  .load_sync = sswap_rdma_read_sync,
+  .load_async = sswap_rdma_read_async,
+  .poll_load = sswap_rdma_poll_load,
+  .invalidate = sswap_rdma_invalidate,
+};
+
+/* idx is absolute id (i.e. > than number of queue sets) */
+inline enum qp_type get_queue_type(unsigned int idx)
+{
+  BUG_ON(idx >= numqueues);
+  return idx / max_qsets;
 }
 
-inline struct rdma_queue *sswap_rdma_get_queue(unsigned int cpuid,
+/* callers hold qset_srcu */
+inline struct rdma_queue *sswap_rdma_get_queue(struct sswap_rdma_ctrl *ctrl,
+					       unsigned int cpuid,
 					       enum qp_type type)
 {
-  BUG_ON(gctrl == NULL);
+  int set;
 
-  //cpuid = cpuid % numqueues;
-  switch (type) {
-    case QP_READ_SYNC:
-      return &gctrl->queues[cpuid];
-    case QP_READ_ASYNC:
-      return &gctrl->queues[cpuid + numcpus];
-    case QP_WRITE_SYNC:
-      return &gctrl->queues[cpuid + numcpus * 2];
-    default:
-      BUG();
-  };
+  BUG_ON(ctrl == NULL);
+
+  set = READ_ONCE(qmap[cpuid]);
+  BUG_ON(set < 0);
+  return ctrl->queues[qset_idx(set, type)];
 }
 
 static int __init sswap_rdma_init_module(void)
 {
-  int ret;
+  int ret, i;
 
   pr_info("start: %s\n", __FUNCTION__);
   pr_info("* RDMA BACKEND *");
 
-  numcpus = num_online_cpus();
-  //numcpus = 8;
-  pr_info("num cpus is :%d\n", numcpus);
-  numqueues = numcpus * 3;
+  ret = sswap_rdma_parse_cv_policy();
+  if (ret)
+    return ret;
+
+  if (strcmp(numa_route, "local") && strcmp(numa_route, "nic")) {
+    pr_err("unknown numa_route %s\n", numa_route);
+    return -EINVAL;
+  }
+
+  if (nr_qsets < 0) {
+    pr_err("invalid nq %d\n", nr_qsets);
+    return -EINVAL;
+  }
+
+  if (!nservers || (nports != 1 && nports != nservers)) {
+    pr_err("need sip and one sport for all servers or one per server\n");
+    return -EINVAL;
+  }
+
+  if (stripe_pages <= 0) {
+    pr_err("invalid stripe_pages %d\n", stripe_pages);
+    return -EINVAL;
+  }
+
+  ret = sswap_rdma_parse_placement();
+  if (ret)
+    return ret;
+
+  if (replicas < 1 || replicas > nservers ||
+      write_quorum < 0 || write_quorum > replicas) {
+    pr_err("invalid replicas %d or write_quorum %d for %d servers\n",
+           replicas, write_quorum, nservers);
+    return -EINVAL;
+  }
+  if (!write_quorum)
+    write_quorum = replicas;
+
+  if (ec_k) {
+    if ((ec_k != 2 && ec_k != 4 && ec_k != 8) || ec_m < 1 || ec_m > 2 ||
+        ec_k + ec_m > nservers || replicas > 1) {
+      pr_err("invalid ec_k %d ec_m %d for %d servers, replicas %d\n",
+             ec_k, ec_m, nservers, replicas);
+      return -EINVAL;
+    }
+    ec_frag = PAGE_SIZE / ec_k;
+  }
+
+  /* set slots are indexed by cpu id when every cpu has its own */
+  max_qsets = nr_qsets ? nr_qsets : nr_cpu_ids;
+  numqueues = max_qsets * NR_QP_TYPES;
   pr_info("num queues is :%d\n", numqueues);
 
-  req_cache = kmem_cache_create("sswap_req_cache", sizeof(struct rdma_req), 0,
-                      SLAB_TEMPORARY | SLAB_HWCACHE_ALIGN, NULL);
+  qmap = kmalloc_array(nr_cpu_ids, sizeof(int), GFP_KERNEL);
+  live_qsets = kcalloc(BITS_TO_LONGS(max_qsets), sizeof(long), GFP_KERNEL);
+  if (!qmap || !live_qsets) {
+    ret = -ENOMEM;
+    goto out_free_qmap;
+  }
+  memset(qmap, -1, nr_cpu_ids * sizeof(int));
+
+  /* reclaim depends on the recovery making progress */
+  recovery_wq = alloc_workqueue("fastswap_rdma_recovery",
+                                WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+  if (!recovery_wq) {
+    ret = -ENOMEM;
+    goto out_free_qmap;
+  }
 
-  if (!req_cache) {
-    pr_err("no memory for cache allocation\n");
-    return -ENOMEM;
+  /* stores can't fail for lack of memory, they are what frees it */
+  if (replicas > 1 || ec_k) {
+    repl_pool = mempool_create_kmalloc_pool(num_online_cpus() * 4,
+                                            sizeof(struct sswap_rdma_repl));
+    if (ec_k) {
+      ecread_pool = mempool_create_kmalloc_pool(
+        num_online_cpus() * 4, sizeof(struct sswap_rdma_ecread));
+      parity_pool = mempool_create_page_pool(num_online_cpus() * 4, 0);
+    }
+    if (!repl_pool || (ec_k && (!ecread_pool || !parity_pool))) {
+      ret = -ENOMEM;
+      goto out_destroy_pools;
+    }
   }
 
   ib_register_client(&sswap_rdma_ib_client);
-  ret = sswap_rdma_create_ctrl(&gctrl);
+  for (i = 0; i < nservers; i++) {
+    ret = sswap_rdma_create_ctrl(&ctrls[i], i);
+    if (ret) {
+      pr_err("could not create ctrl\n");
+      ret = -ENODEV;
+      goto out_free_ctrls;
+    }
+  }
+
+  ret = sswap_rdma_init_queues();
   if (ret) {
-    pr_err("could not create ctrl\n");
-    ib_unregister_client(&sswap_rdma_ib_client);
-    return -ENODEV;
+    pr_err("could not connect queues\n");
+    ret = -ENODEV;
+    goto out_free_queues;
   }
 
-  ret = sswap_rdma_recv_remotemr(gctrl);
+  for (i = 0; i < nservers; i++)
+    WRITE_ONCE(ctrls[i]->state, CTRL_LIVE);
+
+  sswap_rdma_init_debugfs();
+
+  ret = sswap_register_backend(&sswap_rdma_backend);
   if (ret) {
-    pr_err("could not setup remote memory region\n");
-    ib_unregister_client(&sswap_rdma_ib_client);
-    return -ENODEV;
+    pr_err("could not register backend\n");
+    goto out_remove_debugfs;
   }
 
   pr_info("ctrl is ready for reqs\n");
-  int i;
-  for (i = 0; i < numqueues; ++i) {
-    struct ib_qp_attr qp_attr;
-    struct ib_qp_init_attr qp_init_attr;
-    ret = ib_query_qp(&gctrl->queues[i].qp, &qp_attr, IB_QP_STATE|IB_QP_CUR_STATE, &qp_init_attr);
-    if (ret) {
-      pr_err("failed to ib_query_qp for queue: %d\n", i);
-      return -ENODEV;
-    }
-    pr_info("queue %d: qp_state:%d, cur_qp_state:%d\n", i, qp_attr.qp_state, qp_attr.cur_qp_state);
-  }
-
-  pr_info("try alloc a page to test\n");
-  atomic_set(&read_test_done, 0);
-  struct page* test_page = alloc_page(GFP_ATOMIC);
-  //pr_info("try to read_sync first page from remote server\n");
-  struct rdma_queue *q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_SYNC); 
-  /*if(atomic_read(&q->pending)!=0){
-	pr_err("q pending value is not 0 before send rdma!\n");
-	return -ENODEV;
-  }
-  int r = sswap_rdma_read_sync(test_page,0);
-  if (r!=0){
-		  pr_err("send read_sync request to farmemserver failed!\n");
-    	  return -ENODEV;
-  }  
-  int count = 0;
-  while(atomic_read(&q->pending)>0){
-		  ndelay(9000);
-		  if(count % 50000 == 0)
-				  pr_info("waiting read sync request finished.....\n");
-		  count++;
-		  if(count>=1000000){
-				  pr_err("send read_sync request to farmemserver failed!\n");
-				  return -ENODEV;
-		  }
-  }*/
-
-
-  /*pr_info("try to read_async first page from remote server\n");
-  r = sswap_rdma_read_async(test_page,0);
-  if (r!=0){
-		  pr_err("send read_async request to farmemserver failed!\n");
-    	  return -ENODEV;
-  }
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_READ_ASYNC); 
-  while(atomic_read(&q->pending)>0){
-   ndelay(1000);
-   pr_info("waiting read async request finished.....\n");
-  }*/
-
-
-  pr_info("try to write page from remote server\n");
-  int r = sswap_rdma_write(test_page,0);
-  if (r!=0){
-		  pr_err("send write request to farmemserver failed!\n");
-    	  return -ENODEV;
-  }
-  q = sswap_rdma_get_queue(smp_processor_id(), QP_WRITE_SYNC); 
-  int count = 0;
-  while(atomic_read(&q->pending)>0){
-		  ndelay(9000);
-		  if(count % 50000 == 0)
-				  pr_info("waiting write request finished.....\n");
-		  count++;
-		  if(count>=1000000){
-				  pr_err("send write request to farmemserver failed!\n");
-				  return -ENODEV;
-		  }
-  }
-  pr_info("all test completed!\n");
-
   return 0;
+
+out_remove_debugfs:
+  debugfs_remove_recursive(debugfs_root);
+out_free_queues:
+  sswap_rdma_stopandfree_queues();
+  for (i = 0; i < nservers; i++)
+    cancel_work_sync(&ctrls[i]->recovery_work);
+out_free_ctrls:
+  ib_unregister_client(&sswap_rdma_ib_client);
+  for (i = 0; i < nservers; i++) {
+    if (!ctrls[i])
+      continue;
+    kfree(ctrls[i]->queues);
+    kfree(ctrls[i]);
+    ctrls[i] = NULL;
+  }
+out_destroy_pools:
+  sswap_rdma_destroy_pools();
+  destroy_workqueue(recovery_wq);
+out_free_qmap:
+  kfree(qmap);
+  kfree(live_qsets);
+  return ret;
 }
 
 module_init(sswap_rdma_init_module);
@@ -10,11 +10,29 @@
 #include <linux/gfp.h>
 #include <linux/pagemap.h>
 #include <linux/spinlock.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include "fastswap.h"
+
+enum queue_state {
+  QUEUE_CLOSED,
+  QUEUE_LIVE,
+  QUEUE_DOWN, /* link lost, waiting for the recovery */
+};
+
+enum ctrl_state {
+  CTRL_NEW,
+  CTRL_LIVE,
+  CTRL_RECOVERING,
+};
 
 enum qp_type {
   QP_READ_SYNC,
   QP_READ_ASYNC,
-  QP_WRITE_SYNC
+  QP_WRITE_SYNC,
+  NR_QP_TYPES
 };
 
 struct sswap_rdma_dev {
@@ -22,13 +40,61 @@ struct sswap_rdma_dev {
   struct ib_pd *pd;
 };
 
+/* a store written to several servers, shared by the reqs of its replicas
+ * or erasure coded fragments */
+struct sswap_rdma_repl {
+  struct page *page;
+  struct page *parity; /* erasure coding only, parity fragments */
+  atomic_t remaining; /* writes not completed yet */
+  atomic_t acked; /* writes completed successfully */
+  int quorum; /* acks that end writeback */
+  bool pinned; /* holds a page ref for writes past the quorum */
+  bool tracked; /* replication only, slot is busy until every write is done */
+  unsigned long slot;
+};
+
+/* a load of an erasure coded page, shared by the reqs of its fragments */
+struct sswap_rdma_ecread {
+  struct page *page;
+  struct page *parity; /* degraded only, parity fragments read */
+  atomic_t remaining;
+  /* data fragments rebuilt from parity, -1 if none */
+  s8 lost[2];
+  /* parity fragments read into parity, bit 0 for p and 1 for q */
+  u8 pq;
+  /* not every fragment could be read, the page is not up to date */
+  bool failed;
+};
+
+/* page requests live in their queue's ring, see sswap_rdma_alloc_req() */
 struct rdma_req {
   struct completion done;
   struct list_head list;
   struct ib_cqe cqe;
   u64 dma;
+  u64 ts; /* when the wr was posted, for latency stats */
+  u64 roffset;
   struct page *page;
-};
+  u32 len; /* bytes from dma, a fragment or the whole page */
+  struct sswap_rdma_repl *repl; /* replicated or erasure coded writes */
+  struct sswap_rdma_ecread *ecread; /* erasure coded reads */
+  /* reads: the page's offset in swap space and the ctrl ids it was read
+   * from, to fail over to another replica */
+  u64 swapoff;
+  u16 tried;
+  /* set when completed, until the ring's tail moves past the slot */
+  bool freed;
+
+  struct ib_rdma_wr wr;
+  struct ib_sge sge;
+  /* queued on rdma_queue.batch until the chain is posted, and on
+   * rdma_queue.failed when the link took it down */
+  struct llist_node lnode;
+  /* the signaled wr that ends the chain this req was posted in */
+  struct rdma_req *leader;
+  /* leader only: first req of the chain not completed yet */
+  struct rdma_req *batch;
+} ____cacheline_aligned_in_smp;
 
 struct sswap_rdma_ctrl;
 
@@ -37,6 +103,16 @@ struct rdma_queue {
   struct ib_cq *cq;
   spinlock_t cq_lock;
   enum qp_type qp_type;
+  int state; /* QUEUE_* */
+  enum ib_poll_context poll_ctx;
+  int cpu; /* home cpu of the queue set */
+  int comp_vector;
+
+  /* direct cqs only: waiters for a completion interrupt */
+  wait_queue_head_t cq_wait;
+  atomic_t cq_events;
+  /* ewma of post to completion latency in ns, for adaptive polling */
+  u64 lat_ewma;
 
   struct sswap_rdma_ctrl *ctrl;
 
@@ -45,6 +121,25 @@ struct rdma_queue {
   struct completion cm_done;
 
   atomic_t pending;
+  /* wrs posted and not completed yet */
+  atomic_t inflight;
+
+  /* wrs waiting to be posted as one chain */
+  struct llist_head batch;
+  atomic_t nbatch;
+  /* set while prefetches are held back on batch for a demand read */
+  atomic_t deferred;
+  /* wrs lost with the link, posted again after the reconnect */
+  struct llist_head failed;
+
+  /* ring of request slots, one per send queue entry. Posters claim slots
+   * at req_head with cmpxchg, completions free them and move req_tail
+   * over freed slots under ring_lock. */
+  struct rdma_req *reqs;
+  unsigned int nreqs; /* power of 2 */
+  unsigned long req_head;
+  unsigned long req_tail;
+  spinlock_t ring_lock;
 };
 
 struct sswap_rdma_memregion {
@@ -53,10 +148,25 @@ struct sswap_rdma_memregion {
 };
 
 struct sswap_rdma_ctrl {
+  int id; /* index of the server in sip */
   struct sswap_rdma_dev *rdev; // TODO: move this to queue
-  struct rdma_queue *queues;
+  /* [type * max_qsets + set], each on its home cpu's node */
+  struct rdma_queue **queues;
+  /* sent by the server when accepting each queue */
   struct sswap_rdma_memregion servermr;
 
+  int state; /* CTRL_* */
+  wait_queue_head_t live_wait;
+  /* bytes of the server's region holding live pages, and the end of the
+   * part of it ever written */
+  atomic_long_t live_bytes;
+  atomic64_t highwater;
+  /* demand read wrs in flight to the server, from any cpu */
+  atomic_t demand;
+  struct work_struct recovery_work;
+  /* serializes the recovery against queues coming and going */
+  struct mutex recovery_lock;
+
   union {
     struct sockaddr addr;
     struct sockaddr_in addr_in;
@@ -68,11 +178,8 @@ struct sswap_rdma_ctrl {
   };
 };
 
-struct rdma_queue *sswap_rdma_get_queue(unsigned int idx, enum qp_type type);
+struct rdma_queue *sswap_rdma_get_queue(struct sswap_rdma_ctrl *ctrl,
+                                        unsigned int idx, enum qp_type type);
 enum qp_type get_queue_type(unsigned int idx);
-int sswap_rdma_read_async(struct page *page, u64 roffset);
-int sswap_rdma_read_sync(struct page *page, u64 roffset);
-int sswap_rdma_write(struct page *page, u64 roffset);
-int sswap_rdma_poll_load(int cpu);
 
 #endif
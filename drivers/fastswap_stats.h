@@ -0,0 +1,91 @@
+#if !defined(_SSWAP_STATS_H)
+#define _SSWAP_STATS_H
+
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+/* log2 latency histogram in ns. bucket b counts samples in
+ * [2^(b-1), 2^b), bucket 0 counts zeros and the last bucket (~1s)
+ * absorbs everything above it. Histograms live in per-cpu stats and are
+ * only summed up when read from debugfs. */
+#define SSWAP_HIST_BUCKETS 32
+
+struct sswap_hist {
+  u64 buckets[SSWAP_HIST_BUCKETS];
+};
+
+static inline unsigned int sswap_hist_bucket(u64 ns)
+{
+  unsigned int b = fls64(ns);
+
+  return b < SSWAP_HIST_BUCKETS ? b : SSWAP_HIST_BUCKETS - 1;
+}
+
+/* pcp_hist must be a per-cpu lvalue, e.g. my_pcpu_stats.lat[i] */
+#define sswap_hist_record(pcp_hist, ns) \
+  this_cpu_inc((pcp_hist).buckets[sswap_hist_bucket(ns)])
+
+static inline void sswap_hist_add(struct sswap_hist *sum,
+                                  const struct sswap_hist *h)
+{
+  int b;
+
+  for (b = 0; b < SSWAP_HIST_BUCKETS; b++)
+    sum->buckets[b] += h->buckets[b];
+}
+
+static inline u64 sswap_hist_samples(const struct sswap_hist *h)
+{
+  u64 total = 0;
+  int b;
+
+  for (b = 0; b < SSWAP_HIST_BUCKETS; b++)
+    total += h->buckets[b];
+
+  return total;
+}
+
+/* upper bound (in ns) of the bucket holding the permille-th sample */
+static inline u64 sswap_hist_percentile(const struct sswap_hist *h,
+                                        unsigned int permille)
+{
+  u64 total = sswap_hist_samples(h);
+  u64 target, seen = 0;
+  int b;
+
+  if (!total)
+    return 0;
+
+  target = DIV_ROUND_UP_ULL(total * permille, 1000);
+  for (b = 0; b < SSWAP_HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= target)
+      break;
+  }
+
+  return 1ULL << min(b, SSWAP_HIST_BUCKETS - 1);
+}
+
+static inline void sswap_hist_show(struct seq_file *m, const char *name,
+                                   const struct sswap_hist *h)
+{
+  int b, last = 0;
+
+  seq_printf(m, "%s samples=%llu p50<%llu p99<%llu p999<%llu buckets=",
+             name, sswap_hist_samples(h),
+             sswap_hist_percentile(h, 500),
+             sswap_hist_percentile(h, 990),
+             sswap_hist_percentile(h, 999));
+
+  for (b = 0; b < SSWAP_HIST_BUCKETS; b++)
+    if (h->buckets[b])
+      last = b;
+  for (b = 0; b <= last; b++)
+    seq_printf(m, "%s%llu", b ? "," : "", h->buckets[b]);
+  seq_putc(m, '\n');
+}
+
+#endif
@@ -0,0 +1,137 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fastswap
+
+#if !defined(_SSWAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SSWAP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "fastswap_rdma.h"
+
+/* tracepoints are patched-out branches until enabled, e.g.
+ *   echo 1 > /sys/kernel/debug/tracing/events/fastswap/enable
+ * req pointers tie a post to its cqe in the timeline. */
+
+TRACE_DEFINE_ENUM(QP_READ_SYNC);
+TRACE_DEFINE_ENUM(QP_READ_ASYNC);
+TRACE_DEFINE_ENUM(QP_WRITE_SYNC);
+TRACE_DEFINE_ENUM(IB_WR_RDMA_WRITE);
+TRACE_DEFINE_ENUM(IB_WR_RDMA_READ);
+
+#define show_qp_type(type)                      \
+  __print_symbolic(type,                        \
+    { QP_READ_SYNC, "read_sync" },              \
+    { QP_READ_ASYNC, "read_async" },            \
+    { QP_WRITE_SYNC, "write_sync" })
+
+#define show_wr_opcode(op)                      \
+  __print_symbolic(op,                          \
+    { IB_WR_RDMA_WRITE, "write" },              \
+    { IB_WR_RDMA_READ, "read" })
+
+TRACE_EVENT(sswap_rdma_post,
+  TP_PROTO(struct rdma_queue *q, struct rdma_req *req, u64 roffset,
+           enum ib_wr_opcode op),
+  TP_ARGS(q, req, roffset, op),
+
+  TP_STRUCT__entry(
+    __field(u32, qp_num)
+    __field(int, qp_type)
+    __field(const void *, req)
+    __field(u64, roffset)
+    __field(int, op)
+    __field(int, pending)
+  ),
+
+  TP_fast_assign(
+    __entry->qp_num = q->qp->qp_num;
+    __entry->qp_type = q->qp_type;
+    __entry->req = req;
+    __entry->roffset = roffset;
+    __entry->op = op;
+    __entry->pending = atomic_read(&q->pending);
+  ),
+
+  TP_printk("qp=%u type=%s req=%p op=%s roffset=0x%llx pending=%d",
+            __entry->qp_num, show_qp_type(__entry->qp_type), __entry->req,
+            show_wr_opcode(__entry->op), __entry->roffset, __entry->pending)
+);
+
+TRACE_EVENT(sswap_rdma_cqe,
+  TP_PROTO(struct rdma_queue *q, struct rdma_req *req, struct ib_wc *wc,
+           u64 latency),
+  TP_ARGS(q, req, wc, latency),
+
+  TP_STRUCT__entry(
+    __field(u32, qp_num)
+    __field(int, qp_type)
+    __field(const void *, req)
+    __field(int, status)
+    __field(u64, latency)
+  ),
+
+  TP_fast_assign(
+    __entry->qp_num = q->qp->qp_num;
+    __entry->qp_type = q->qp_type;
+    __entry->req = req;
+    __entry->status = wc->status;
+    __entry->latency = latency;
+  ),
+
+  TP_printk("qp=%u type=%s req=%p status=%d latency=%lluns",
+            __entry->qp_num, show_qp_type(__entry->qp_type), __entry->req,
+            __entry->status, __entry->latency)
+);
+
+TRACE_EVENT(sswap_rdma_backpressure,
+  TP_PROTO(struct rdma_queue *q, int inflight),
+  TP_ARGS(q, inflight),
+
+  TP_STRUCT__entry(
+    __field(u32, qp_num)
+    __field(int, qp_type)
+    __field(int, inflight)
+  ),
+
+  TP_fast_assign(
+    __entry->qp_num = q->qp->qp_num;
+    __entry->qp_type = q->qp_type;
+    __entry->inflight = inflight;
+  ),
+
+  TP_printk("qp=%u type=%s inflight=%d",
+            __entry->qp_num, show_qp_type(__entry->qp_type),
+            __entry->inflight)
+);
+
+/* err is a negative errno for failed posts and an ib_wc_status for
+ * failed completions */
+TRACE_EVENT(sswap_rdma_error,
+  TP_PROTO(struct rdma_queue *q, struct rdma_req *req, int err),
+  TP_ARGS(q, req, err),
+
+  TP_STRUCT__entry(
+    __field(u32, qp_num)
+    __field(int, qp_type)
+    __field(const void *, req)
+    __field(int, err)
+  ),
+
+  TP_fast_assign(
+    __entry->qp_num = q->qp->qp_num;
+    __entry->qp_type = q->qp_type;
+    __entry->req = req;
+    __entry->err = err;
+  ),
+
+  TP_printk("qp=%u type=%s req=%p err=%d",
+            __entry->qp_num, show_qp_type(__entry->qp_type), __entry->req,
+            __entry->err)
+);
+
+#endif /* _SSWAP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fastswap_trace
+#include <trace/define_trace.h>
@@ -8,9 +8,9 @@
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 const size_t BUFFER_SIZE = 1024 * 1024 * 1024 * 32l;
-const unsigned int NUM_PROCS = 8;
-const unsigned int NUM_QUEUES_PER_PROC = 3;
-const unsigned int NUM_QUEUES = NUM_PROCS * NUM_QUEUES_PER_PROC;
+// clients connect a set of 3 queues per cpu (or per nq), and sets come and
+// go with cpu hotplug, so queues are accepted for as long as we run
+const int LISTEN_BACKLOG = 128;
 
 struct device {
   struct ibv_pd *pd;
@@ -29,7 +29,7 @@ struct queue {
 };
 
 struct ctrl {
-  struct queue *queues;
+  unsigned int nr_queues;
   struct ibv_mr *mr_buffer;
   void *buffer;
   struct device *dev;
@@ -52,7 +52,6 @@ static int on_event(struct rdma_cm_event *event);
 static void destroy_device(struct ctrl *ctrl);
 
 static struct ctrl *gctrl = NULL;
-static unsigned int queue_ctr = 0;
 
 int main(int argc, char **argv)
 {
@@ -74,41 +73,11 @@ int main(int argc, char **argv)
   TEST_Z(ec = rdma_create_event_channel());
   TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
   TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
-  TEST_NZ(rdma_listen(listener, NUM_QUEUES + 1));
+  TEST_NZ(rdma_listen(listener, LISTEN_BACKLOG));
   port = ntohs(rdma_get_src_port(listener));
   printf("listening on port %d.\n", port);
 
-  for (unsigned int i = 0; i < NUM_QUEUES; ++i) {
-    printf("waiting for queue connection: %d\n", i);
-    struct queue *q = &gctrl->queues[i];
-
-    // handle connection requests
-    while (rdma_get_cm_event(ec, &event) == 0) {
-      struct rdma_cm_event event_copy;
-
-      memcpy(&event_copy, event, sizeof(*event));
-      rdma_ack_cm_event(event);
-
-      if (on_event(&event_copy) || q->state == queue::CONNECTED)
-        break;
-    }
-  }
-
-  printf("done connecting all queues\n");
-  printf("check all qp ready....");
-  for (unsigned int i = 0; i < NUM_QUEUES; ++i) {
-    struct queue *q = &gctrl->queues[i];
-    struct ibv_qp_attr attr;
-    struct ibv_qp_init_attr init_attr;
-    int r = ibv_query_qp(q->qp, &attr, IBV_QP_STATE|IBV_QP_CUR_STATE, &init_attr );
-    if(r!=0){
-      printf("ibv_query_qp for queue %d failed! msg:%s\n",i, strerror(errno));
-      return 1;
-    }
-    printf("for the qp %d, qp_state is %d, cur_qp_state is %d, init_attr.sq_sig_all:%d\n", i, attr.qp_state, attr.cur_qp_state,init_attr.sq_sig_all);
-  }
-
-  // handle disconnects, etc.
+  // handle connection requests, disconnects, etc.
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
 
@@ -137,15 +106,6 @@ int alloc_control()
   TEST_Z(gctrl);
   memset(gctrl, 0, sizeof(struct ctrl));
 
-  gctrl->queues = (struct queue *) malloc(sizeof(struct queue) * NUM_QUEUES);
-  TEST_Z(gctrl->queues);
-  memset(gctrl->queues, 0, sizeof(struct queue) * NUM_QUEUES);
-  for (unsigned int i = 0; i < NUM_QUEUES; ++i) {
-    gctrl->queues[i].ctrl = gctrl;
-    gctrl->queues[i].state = queue::INIT;
-  }
-
-
   return 0;
 }
 
@@ -210,9 +170,12 @@ int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
 
   struct rdma_conn_param cm_params = {};
   struct ibv_device_attr attrs = {};
-  struct queue *q = &gctrl->queues[queue_ctr++];
+  struct memregion servermr = {};
+  struct queue *q = (struct queue *) calloc(1, sizeof(struct queue));
 
-  TEST_Z(q->state == queue::INIT);
+  TEST_Z(q);
+  q->ctrl = gctrl;
+  q->state = queue::INIT;
   printf("%s\n", __FUNCTION__);
 
   id->context = q;
@@ -242,6 +205,14 @@ int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
   cm_params.rnr_retry_count = param->rnr_retry_count;
   cm_params.flow_control = param->flow_control;
 
+  // every queue gets the memory region with the accept, so a client that
+  // reconnects after losing the link learns it again
+  servermr.baseaddr = (uint64_t) q->ctrl->mr_buffer->addr;
+  servermr.key  = q->ctrl->mr_buffer->rkey;
+  cm_params.private_data = &servermr;
+  cm_params.private_data_len = sizeof(servermr);
+  printf("MR key=%u base vaddr=%p\n", servermr.key, q->ctrl->mr_buffer->addr);
+
   TEST_NZ(rdma_accept(q->cm_id, &cm_params));
 
   return 0;
@@ -254,32 +225,9 @@ int on_connection(struct queue *q)
 
   TEST_Z(q->state == queue::INIT);
 
-  if (q == &ctrl->queues[0]) {
-    struct ibv_send_wr wr = {};
-    struct ibv_send_wr *bad_wr = NULL;
-    struct ibv_sge sge = {};
-    struct memregion servermr = {};
-
-    printf("connected. sending memory region info.\n");
-    printf("MR key=%u base vaddr=%p\n", ctrl->mr_buffer->rkey, ctrl->mr_buffer->addr);
-
-    servermr.baseaddr = (uint64_t) ctrl->mr_buffer->addr;
-    servermr.key  = ctrl->mr_buffer->rkey;
-
-    wr.opcode = IBV_WR_SEND;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
-
-    sge.addr = (uint64_t) &servermr;
-    sge.length = sizeof(servermr);
-
-    TEST_NZ(ibv_post_send(q->qp, &wr, &bad_wr));
-
-    // TODO: poll here
-  }
-
   q->state = queue::CONNECTED;
+  ctrl->nr_queues++;
+  printf("%u queues connected\n", ctrl->nr_queues);
   return 0;
 }
 
@@ -291,7 +239,10 @@ int on_disconnect(struct queue *q)
     q->state = queue::INIT;
     rdma_destroy_qp(q->cm_id);
     rdma_destroy_id(q->cm_id);
+    q->ctrl->nr_queues--;
+    printf("%u queues connected\n", q->ctrl->nr_queues);
   }
+  free(q);
 
   return 0;
 }
@@ -307,11 +258,13 @@ int on_event(struct rdma_cm_event *event)
     case RDMA_CM_EVENT_ESTABLISHED:
       return on_connection(q);
     case RDMA_CM_EVENT_DISCONNECTED:
-      on_disconnect(q);
-      return 1;
+      // a client cpu went offline, or the client is gone. keep the
+      // buffer for the queues that are left or come back
+      return on_disconnect(q);
     default:
+      // e.g. a client queue that failed to connect, it retries
       printf("unknown event: %s\n", rdma_event_str(event->event));
-      return 1;
+      return 0;
   }
 }
 